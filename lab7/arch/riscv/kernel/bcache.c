@@ -0,0 +1,595 @@
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+#include "slub.h"
+#include "virtio.h"
+#include "vm.h"
+#include "mm.h"
+#include "sched.h"
+
+// --------------------------------------------------
+// ----------- read and write interface -------------
+// --------------------------------------------------
+
+void disk_op(int blockno, uint8_t *data, bool write) {
+    struct buf b;
+    b.disk = 0;
+    b.blockno = blockno;
+    b.data = (uint8_t *)PHYSICAL_ADDR(data);
+    b.nseg = 0;
+    virtio_disk_rw((struct buf *)(PHYSICAL_ADDR(&b)), write);
+}
+
+// transfer blocks from blockno on directly between the disk and the
+// segments (physical addresses), bypassing the buffer. sleeps until the
+// request is done and returns the device status, 0 on success.
+int disk_direct_io(uint32_t blockno, struct buf_seg *seg, int nseg, bool write) {
+    struct buf b;
+    b.disk = 0;
+    b.blockno = blockno;
+    b.nseg = nseg;
+    for (int i = 0; i < nseg; i++) b.seg[i] = seg[i];
+    virtio_disk_submit((struct buf *)PHYSICAL_ADDR(&b), write);
+    int status = virtio_disk_wait((struct buf *)PHYSICAL_ADDR(&b));
+    if (status != 0) printf("error: direct I/O failed, blockno = %d\n", blockno);
+    return status;
+}
+
+// the task may sleep on disk I/O inside the file system, other tasks
+// entering sfs_* wait here until it is done
+static int sfs_locked = 0;
+static struct task_struct *sfs_owner = NULL;
+
+void sfs_lock() {
+    while (sfs_locked) schedule(0);
+    sfs_locked = 1;
+    sfs_owner = current;
+}
+
+// for the timer path, which must not sleep
+int sfs_trylock() {
+    if (sfs_locked) return 0;
+    sfs_locked = 1;
+    sfs_owner = current;
+    return 1;
+}
+
+void sfs_unlock() {
+    sfs_locked = 0;
+    sfs_owner = NULL;
+}
+
+// a fault on user memory from inside sfs_* must not wait for itself
+bool sfs_lock_held() {
+    return sfs_locked && sfs_owner == current;
+}
+
+// --------------------------------------------------
+// ------------------ Buffer Cache ------------------
+// --------------------------------------------------
+// 所有缓存块同时挂在两条链上：
+//   hash[blockno % SFS_HASH_SIZE] 用于 O(1) 查找
+//   lru 按最近使用排序，表头最新，换出时从表尾找第一个未被 pin 的块
+// 脏块另外挂在 dirty 链上，按变脏的先后排序，定时回写从表头取老化的块。
+// sfs_write 追加的新块先使用临时块号（延迟分配），回写前才分配真实块号，
+// 这样一个文件连续的小写入最终落在连续的磁盘块上。
+
+static uint32_t hash_fn(uint32_t blockno) {
+    return blockno % SFS_HASH_SIZE;
+}
+
+// set while buffer_allocate_delayed() runs, it may read blocks itself
+static bool allocating = 0;
+
+static void buffer_allocate_delayed(bool nowait);
+
+static bool buffer_busy(mem_block_ptr node) {
+    return node->io != NULL && node->io->b.disk;
+}
+
+// queue one request for a run of blocks with consecutive blocknos,
+// several requests can be in flight at once
+static void buffer_submit_run(mem_block_ptr *nodes, int n, int write) {
+    struct sfs_io *io = (struct sfs_io *)kmalloc(sizeof(struct sfs_io));
+    io->refs = n;
+    io->b.blockno = nodes[0]->blockno;
+    io->b.nseg = n;
+    for (int i = 0; i < n; i++) {
+        io->b.seg[i].addr = (uint8_t *)PHYSICAL_ADDR(nodes[i]->block.block);
+        io->b.seg[i].len = SFS_BLOCK_SIZE;
+        nodes[i]->io = io;
+    }
+    virtio_disk_submit((struct buf *)PHYSICAL_ADDR(&io->b), write);
+}
+
+// wait for the request covering node, and detach node from it
+static void buffer_wait(mem_block_ptr node) {
+    struct sfs_io *io = node->io;
+    if (io == NULL) return;
+    if (virtio_disk_wait((struct buf *)PHYSICAL_ADDR(&io->b)) != 0) {
+        printf("error: disk I/O failed, blockno = %d\n", node->blockno);
+    }
+    node->io = NULL;
+    if (--io->refs == 0) kfree(io);
+}
+
+static void buffer_mark_dirty(mem_block_ptr node) {
+    if (node->dirty) return;
+    node->dirty = 1;
+    node->dirtied_at = jiffies;
+    list_add_tail(&node->dirty_list, &__sfs->buffer.dirty);
+    __sfs->buffer.nr_dirty++;
+}
+
+static void buffer_clear_dirty(mem_block_ptr node) {
+    if (!node->dirty) return;
+    node->dirty = 0;
+    list_del_init(&node->dirty_list);
+    __sfs->buffer.nr_dirty--;
+}
+
+// block contents, page aligned so that shared file mappings can map them
+static struct kmem_cache *block_cache;
+
+// under memory pressure: free up to nr clean, unpinned buffers from the
+// cold end of the LRU. the cache grows back to its capacity on demand.
+// sfs code keeps unpinned pointers from read_block() while it holds the
+// lock, so nothing is freed then (the holder may be asleep on the disk).
+// a block is one page, nr blocks are freed.
+static uint64_t buffer_shrink(uint64_t nr) {
+    if (__sfs == NULL || sfs_locked) return 0;
+    struct sfs_buffer *cache = &__sfs->buffer;
+    struct list_head *l, *prev;
+    uint64_t freed = 0;
+    for (l = cache->lru.prev; l != &cache->lru && freed < nr; l = prev) {
+        prev = l->prev;
+        mem_block_ptr node = list_entry(l, mem_block, lru_list);
+        if (node->pin_count > 0 || node->dirty || node->io != NULL ||
+            SFS_IS_DELALLOC(node->blockno))
+            continue;
+        list_del(&node->hash_list);
+        list_del(&node->lru_list);
+        kmem_cache_free(node->block.block);
+        kfree(node);
+        cache->nr_blocks--;
+        cache->shrunk++;
+        freed++;
+    }
+    return freed;
+}
+
+static struct shrinker buffer_shrinker = {
+    .name = "bcache", .seeks = 2, .scan = buffer_shrink};
+
+void buffer_init(uint32_t capacity) {
+    struct sfs_buffer *cache = &__sfs->buffer;
+    // every user reads the block from disk or clears it first
+    if (block_cache == NULL) {
+        block_cache = kmem_cache_create("sfs-block", SFS_BLOCK_SIZE, PAGE_SIZE, SLAB_NOZERO, NULL);
+        register_shrinker(&buffer_shrinker);
+    }
+    for (int i = 0; i < SFS_HASH_SIZE; i++) INIT_LIST_HEAD(&cache->hash[i]);
+    INIT_LIST_HEAD(&cache->lru);
+    INIT_LIST_HEAD(&cache->dirty);
+    cache->nr_blocks = 0;
+    cache->capacity = capacity;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    cache->writebacks = 0;
+    cache->nr_dirty = 0;
+    cache->nr_delalloc = 0;
+    cache->next_pseudo = SFS_DELALLOC_BASE;
+    cache->flushes = 0;
+    cache->direct = 0;
+    cache->shrunk = 0;
+}
+
+void buffer_stat() {
+    struct sfs_buffer *cache = &__sfs->buffer;
+    printf("[bcache] blocks %d/%d hits %d misses %d evictions %d writebacks %d\n",
+           cache->nr_blocks, cache->capacity, cache->hits, cache->misses,
+           cache->evictions, cache->writebacks);
+    printf("[bcache] dirty %d delalloc %d flushed %d direct %d shrunk %d\n",
+           cache->nr_dirty, cache->nr_delalloc, cache->flushes, cache->direct,
+           cache->shrunk);
+}
+
+static mem_block_ptr buffer_lookup(uint32_t blockno) {
+    mem_block_ptr node;
+    list_for_each_entry(node, &__sfs->buffer.hash[hash_fn(blockno)], hash_list) {
+        if (node->blockno == blockno) return node;
+    }
+    return NULL;
+}
+
+// move node to the head of lru list
+static void buffer_touch(mem_block_ptr node) {
+    list_move(&node->lru_list, &__sfs->buffer.lru);
+}
+
+// a new node at the head of the lru list, NULL when out of memory
+static mem_block_ptr buffer_alloc() {
+    struct sfs_buffer *cache = &__sfs->buffer;
+    mem_block_ptr node = (mem_block_ptr)kmalloc(sizeof(mem_block));
+    if (node == NULL) return NULL;
+    node->block.block = (char *)kmem_cache_alloc(block_cache);
+    if (node->block.block == NULL) {
+        kfree(node);
+        return NULL;
+    }
+    node->io = NULL;
+    node->dirty = 0;
+    INIT_LIST_HEAD(&node->hash_list);
+    INIT_LIST_HEAD(&node->dirty_list);
+    list_add(&node->lru_list, &cache->lru);
+    cache->nr_blocks++;
+    return node;
+}
+
+// get a node not in the hash table: allocate a new one while under capacity,
+// otherwise evict the least recently used unpinned block and reuse its memory.
+// NULL when nothing can be evicted and there is no memory to grow.
+static mem_block_ptr buffer_get_free() {
+    struct sfs_buffer *cache = &__sfs->buffer;
+    mem_block_ptr node;
+    struct list_head *l;
+    if (cache->nr_blocks < cache->capacity) return buffer_alloc();
+    while (1) {
+        // delayed blocks have nowhere to go on disk yet, they leave the
+        // cache only after buffer_allocate_delayed() gave them a blockno
+        for (l = cache->lru.prev; l != &cache->lru; l = l->prev) {
+            node = list_entry(l, mem_block, lru_list);
+            if (node->pin_count == 0 && !buffer_busy(node) && !SFS_IS_DELALLOC(node->blockno)) break;
+        }
+        if (l != &cache->lru) break;
+        // try again only if some block got its blockno, the disk may be full
+        uint32_t nr_delalloc = cache->nr_delalloc;
+        if (nr_delalloc > 0 && !allocating) {
+            buffer_allocate_delayed(0);
+            if (cache->nr_delalloc < nr_delalloc) continue;
+        }
+        // every block is pinned, grow beyond capacity rather than fail
+        printf("warning: all %d buffers pinned\n", cache->nr_blocks);
+        node = buffer_alloc();
+        if (node != NULL) cache->capacity++;
+        return node;
+    }
+    buffer_wait(node);
+    if (node->dirty) {
+        buffer_clear_dirty(node);
+        buffer_submit_run(&node, 1, 1);
+        buffer_wait(node);
+        cache->writebacks++;
+    }
+    list_del_init(&node->hash_list);
+    buffer_touch(node);
+    cache->evictions++;
+    return node;
+}
+
+// NULL when no buffer is left, see buffer_get_free()
+static mem_block_ptr buffer_insert(uint32_t blockno, bool is_inode, bool dirty) {
+    mem_block_ptr node = buffer_get_free();
+    if (node == NULL) return NULL;
+    node->blockno = blockno;
+    node->is_inode = is_inode;
+    node->pin_count = 0;
+    node->da_inode = 0;
+    node->da_idx = 0;
+    list_add(&node->hash_list, &__sfs->buffer.hash[hash_fn(blockno)]);
+    if (dirty) buffer_mark_dirty(node);
+    return node;
+}
+
+bool buffer_cached(uint32_t blockno) {
+    return buffer_lookup(blockno) != NULL;
+}
+
+int set_block_dirty(int block_num){
+    mem_block_ptr ptr;
+    if (get_block_from_buffer(block_num, &ptr)) {
+        buffer_mark_dirty(ptr);
+        return 1;
+    }
+    return 0;
+}
+int get_block_from_buffer(uint32_t blockno, struct sfs_memory_block **block) {
+    mem_block_ptr node = buffer_lookup(blockno);
+    if (node == NULL) return 0;
+    buffer_wait(node);
+    *block = node;
+    return 1;
+}
+// NULL when the block is not cached and no buffer is left for it
+uint8_t *read_block(uint32_t blockno, bool is_inode){
+    // try to get from buffer
+    mem_block_ptr node = buffer_lookup(blockno);
+    if (node != NULL) {
+        __sfs->buffer.hits++;
+        buffer_touch(node);
+        buffer_wait(node);
+        return (uint8_t *)node->block.block;
+    }
+    if (SFS_IS_DELALLOC(blockno)) {
+        printf("error: delayed block %x not in buffer\n", blockno);
+        while(1);
+    }
+    // read from disk
+    __sfs->buffer.misses++;
+    node = buffer_insert(blockno, is_inode, 0);
+    if (node == NULL) return NULL;
+    buffer_submit_run(&node, 1, 0);
+    buffer_wait(node);
+    return (uint8_t *)node->block.block;
+}
+int write_block(uint32_t blockno, bool is_inode, uint8_t *buf){
+    // try to get from buffer
+    // buf should be from buffer
+    mem_block_ptr node = buffer_lookup(blockno);
+    if (node != NULL) {
+        buffer_wait(node);
+        if ((uint8_t *)node->block.block != buf){
+            printf("error, block addr = %x, buf addr = %x\n", node->block.block, buf);
+            while(1);
+        }
+        buffer_mark_dirty(node);
+        buffer_touch(node);
+        return 0; // indicate a write hit, no need to write to disk and buf can't be freed by caller
+    }
+    // buf is not persistent
+    // so do copy here
+    node = buffer_insert(blockno, is_inode, 1);
+    // no buffer left, the block goes straight to the disk
+    if (node == NULL) {
+        disk_op(blockno, buf, 1);
+        return 1;
+    }
+    memcpy(node->block.block, buf, SFS_BLOCK_SIZE);
+    return 1; // indicate a write miss and buf can be freed by caller
+}
+// unpin a block
+int recycle_block(uint32_t blockno){
+    mem_block_ptr node = buffer_lookup(blockno);
+    if (node == NULL) return 0;
+    if (node->pin_count > 0) node->pin_count--;
+    return 1;
+}
+// pin a block so that it will not be evicted
+int reclaim_block(uint32_t blockno){
+    mem_block_ptr node = buffer_lookup(blockno);
+    if (node == NULL) return 0;
+    node->pin_count++;
+    return 1;
+}
+// bring blocks into the buffer without waiting for them. runs of uncached
+// blocks with consecutive blocknos are merged into one request, read_block()
+// waits for the request when the block is used.
+void buffer_prefetch(uint32_t *blocknos, int n, bool is_inode) {
+    mem_block_ptr run[BUF_MAX_SEG];
+    int len = 0;
+    // all runs go to the device with one notify
+    virtio_disk_plug();
+    for (int i = 0; i <= n; i++) {
+        uint32_t blockno = i < n ? blocknos[i] : 0;
+        bool cached = blockno == 0 || buffer_lookup(blockno) != NULL;
+        if (len > 0 && (cached || len == BUF_MAX_SEG || blockno != run[len - 1]->blockno + 1)) {
+            for (int j = 0; j < len; j++) run[j]->pin_count--;
+            buffer_submit_run(run, len, 0);
+            len = 0;
+        }
+        if (cached) continue;
+        // read_block() tries again when the block is used
+        run[len] = buffer_insert(blockno, is_inode, 0);
+        if (run[len] == NULL) continue;
+        __sfs->buffer.misses++;
+        // keep the run from being evicted while it is assembled
+        run[len]->pin_count++;
+        len++;
+    }
+    virtio_disk_unplug();
+}
+
+// a zeroed dirty block for block idx of file ino, under a pseudo blockno
+// that is replaced by a real one when the block is written back.
+// returns 0 when the disk has no room left for it.
+uint32_t buffer_delalloc(uint32_t ino, uint32_t idx) {
+    struct sfs_buffer *cache = &__sfs->buffer;
+    if (cache->nr_delalloc >= __sfs->super.unused_blocks) return 0;
+    uint32_t blockno = cache->next_pseudo++;
+    if (cache->next_pseudo == 0) cache->next_pseudo = SFS_DELALLOC_BASE;
+    mem_block_ptr node = buffer_insert(blockno, 0, 1);
+    if (node == NULL) return 0;
+    memset(node->block.block, 0, SFS_BLOCK_SIZE);
+    node->da_inode = ino;
+    node->da_idx = idx;
+    cache->nr_delalloc++;
+    return blockno;
+}
+
+// the cached, idle block blockno, or NULL. never sleeps.
+static mem_block_ptr buffer_peek(uint32_t blockno) {
+    mem_block_ptr node = buffer_lookup(blockno);
+    if (node == NULL || buffer_busy(node)) return NULL;
+    return node;
+}
+
+uint8_t *peek_block(uint32_t blockno) {
+    mem_block_ptr node = buffer_peek(blockno);
+    if (node == NULL) return NULL;
+    buffer_wait(node);
+    buffer_touch(node);
+    return (uint8_t *)node->block.block;
+}
+
+// a zeroed dirty buffer for a block just allocated, its old content on
+// disk is never read. NULL when no buffer is left.
+uint8_t *buffer_new_block(uint32_t blockno, bool is_inode) {
+    mem_block_ptr node = buffer_lookup(blockno);
+    if (node != NULL) {
+        buffer_wait(node);
+        node->is_inode = is_inode;
+        buffer_mark_dirty(node);
+        buffer_touch(node);
+    } else {
+        node = buffer_insert(blockno, is_inode, 1);
+        if (node == NULL) return NULL;
+    }
+    memset(node->block.block, 0, SFS_BLOCK_SIZE);
+    return (uint8_t *)node->block.block;
+}
+
+// forget a block without writing it, e.g. a delayed block that could not
+// be mapped. the buffer is reused first.
+void buffer_drop(uint32_t blockno) {
+    mem_block_ptr node = buffer_lookup(blockno);
+    if (node == NULL) return;
+    buffer_wait(node);
+    buffer_clear_dirty(node);
+    if (SFS_IS_DELALLOC(node->blockno)) __sfs->buffer.nr_delalloc--;
+    list_del_init(&node->hash_list);
+    node->pin_count = 0;
+    list_move_tail(&node->lru_list, &__sfs->buffer.lru);
+}
+
+// give every delayed block its real blockno. blocks are handled sorted by
+// (file, index in file) so each file's new blocks are allocated back to
+// back. with nowait (timer path) a block whose inode or indirect block is
+// not cached is left for a later round instead of sleeping on the read.
+static void buffer_allocate_delayed(bool nowait) {
+    struct sfs_buffer *cache = &__sfs->buffer;
+    if (cache->nr_delalloc == 0) return;
+    allocating = 1;
+    mem_block_ptr *delayed = (mem_block_ptr *)kmalloc(sizeof(mem_block_ptr) * cache->nr_delalloc);
+    if (delayed == NULL) {
+        allocating = 0;
+        return;
+    }
+    mem_block_ptr node;
+    int n = 0;
+    list_for_each_entry(node, &cache->dirty, dirty_list) {
+        if (!SFS_IS_DELALLOC(node->blockno)) continue;
+        int i = n++;
+        while (i > 0 && (delayed[i - 1]->da_inode > node->da_inode ||
+               (delayed[i - 1]->da_inode == node->da_inode && delayed[i - 1]->da_idx > node->da_idx))) {
+            delayed[i] = delayed[i - 1];
+            i--;
+        }
+        delayed[i] = node;
+    }
+    for (int i = 0; i < n; i++) {
+        node = delayed[i];
+        struct sfs_inode *inode;
+        if (nowait) {
+            inode = (struct sfs_inode *)peek_block(node->da_inode);
+            if (inode == NULL) continue;
+        } else {
+            inode = (struct sfs_inode *)read_block(node->da_inode, 1);
+            if (inode == NULL) continue;
+        }
+        reclaim_block(node->da_inode);
+        // right after the file's previous block when it is known
+        uint32_t blockno = next_free_block_near(block_goal(inode, node->da_idx, nowait));
+        int err = set_block_idx(inode, node->da_idx, blockno, nowait);
+        recycle_block(node->da_inode);
+        if (err != 0) {
+            release_block(blockno);
+            continue;
+        }
+        set_block_dirty(node->da_inode);
+        list_del_init(&node->hash_list);
+        node->blockno = blockno;
+        list_add(&node->hash_list, &cache->hash[hash_fn(blockno)]);
+        node->da_inode = 0;
+        cache->nr_delalloc--;
+    }
+    kfree(delayed);
+    allocating = 0;
+}
+
+// queue writes for dirty blocks, in blockno order with runs of consecutive
+// blocks merged into one request. only blocks dirty for at least `age`
+// ticks are taken, and busy blocks are skipped when not waiting. the
+// blocks written are returned in *out (kfree by the caller), their count
+// as the return value.
+static int buffer_write_dirty(uint64_t age, bool nowait, mem_block_ptr **out) {
+    struct sfs_buffer *cache = &__sfs->buffer;
+    mem_block_ptr *dirty = (mem_block_ptr *)kmalloc(sizeof(mem_block_ptr) * (cache->nr_dirty + 1));
+    mem_block_ptr node, tmp;
+    int n = 0;
+    list_for_each_entry_safe(node, tmp, &cache->dirty, dirty_list) {
+        // the list is in dirtying order, the rest is younger
+        if (jiffies - node->dirtied_at < age) break;
+        if (SFS_IS_DELALLOC(node->blockno)) continue;
+        if (nowait && buffer_busy(node)) continue;
+        buffer_wait(node);
+        // insertion sort by blockno
+        int i = n++;
+        while (i > 0 && dirty[i - 1]->blockno > node->blockno) {
+            dirty[i] = dirty[i - 1];
+            i--;
+        }
+        dirty[i] = node;
+    }
+    int start = 0;
+    virtio_disk_plug();
+    for (int i = 1; i <= n; i++) {
+        if (i == n || i - start == BUF_MAX_SEG || dirty[i]->blockno != dirty[i - 1]->blockno + 1) {
+            for (int j = start; j < i; j++) buffer_clear_dirty(dirty[j]);
+            buffer_submit_run(dirty + start, i - start, 1);
+            start = i;
+        }
+    }
+    virtio_disk_unplug();
+    *out = dirty;
+    return n;
+}
+
+// write back every dirty block and wait for the writes.
+void buffer_sync() {
+    mem_block_ptr *dirty;
+    buffer_allocate_delayed(0);
+    sfs_sync_super(0);
+    int n = buffer_write_dirty(0, 0, &dirty);
+    for (int i = 0; i < n; i++) buffer_wait(dirty[i]);
+    kfree(dirty);
+}
+
+// write block blockno back now if it is dirty and wait for the write.
+// a delayed block gets its real blockno first, which is returned.
+uint32_t buffer_flush_block(uint32_t blockno) {
+    mem_block_ptr node = buffer_lookup(blockno);
+    if (node == NULL) return blockno;
+    if (SFS_IS_DELALLOC(node->blockno)) buffer_allocate_delayed(0);
+    buffer_wait(node);
+    if (node->dirty && !SFS_IS_DELALLOC(node->blockno)) {
+        buffer_clear_dirty(node);
+        buffer_submit_run(&node, 1, 1);
+        buffer_wait(node);
+    }
+    return node->blockno;
+}
+
+// queue writes for blocks dirty longer than SFS_DIRTY_EXPIRE without
+// waiting for them, the requests are reaped by later buffer_wait() calls.
+void buffer_flush_aged() {
+    mem_block_ptr *dirty;
+    buffer_allocate_delayed(1);
+    sfs_sync_super(1);
+    int n = buffer_write_dirty(SFS_DIRTY_EXPIRE, 1, &dirty);
+    __sfs->buffer.flushes += n;
+    kfree(dirty);
+}
+
+// called on every timer interrupt. these only arrive while a task runs in
+// user mode (sstatus.SIE is clear in the kernel), so kmalloc and the
+// buffer lists are never caught halfway; a task sleeping inside sfs_*
+// holds the lock and the flush is simply retried next interval.
+void sfs_flusher_tick() {
+    if (__sfs == NULL || !__sfs->meta.init) return;
+    if (jiffies % SFS_FLUSH_INTERVAL != 0) return;
+    if (__sfs->buffer.nr_dirty == 0) return;
+    if (!sfs_trylock()) return;
+    buffer_flush_aged();
+    sfs_unlock();
+}
@@ -0,0 +1,127 @@
+#include "fs.h"
+#include "defs.h"
+#include "mm.h"
+#include "slub.h"
+#include "stdio.h"
+
+// --------------------------------------------------
+// ------------------ Dentry Cache ------------------
+// --------------------------------------------------
+// (父目录 inode, 文件名) -> inode，ino 为 0 的是负项，记录“该目录下没有这个名字”。
+// 与 buffer cache 相同，所有项挂在 hash[name_hash ^ parent] 和 lru 两条链上，
+// 满了以后复用 lru 表尾的项。目录只会增加目录项，所以只有 register_entry
+// 需要更新缓存 (mkdir/touch 都经过它)。
+
+static uint32_t dcache_hash(uint32_t parent, uint32_t h) {
+    return (h ^ parent) % SFS_DCACHE_HASH;
+}
+
+static bool name_eq(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static void name_copy(char *dst, const char *src) {
+    while (*src) *dst++ = *src++;
+    *dst = '\0';
+}
+
+// under memory pressure: drop least recently used dentries, enough to
+// fill nr pages. returns the pages they filled, rounded up
+static uint64_t dcache_shrink(uint64_t nr) {
+    if (__sfs == NULL) return 0;
+    struct sfs_dcache *cache = &__sfs->dcache;
+    uint64_t n = nr * (PAGE_SIZE / sizeof(struct sfs_dentry));
+    uint64_t freed = 0;
+    while (freed < n && !list_empty(&cache->lru)) {
+        struct sfs_dentry *d = list_entry(cache->lru.prev, struct sfs_dentry, lru_list);
+        list_del(&d->hash_list);
+        list_del(&d->lru_list);
+        kfree(d);
+        cache->nr_dentries--;
+        freed++;
+    }
+    return (freed * sizeof(struct sfs_dentry) + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static struct shrinker dcache_shrinker = {
+    .name = "dcache", .seeks = 2, .scan = dcache_shrink};
+
+void dcache_init(uint32_t capacity) {
+    struct sfs_dcache *cache = &__sfs->dcache;
+    static bool registered = 0;
+    if (!registered) {
+        register_shrinker(&dcache_shrinker);
+        registered = 1;
+    }
+    for (int i = 0; i < SFS_DCACHE_HASH; i++) INIT_LIST_HEAD(&cache->hash[i]);
+    INIT_LIST_HEAD(&cache->lru);
+    cache->nr_dentries = 0;
+    cache->capacity = capacity;
+    cache->hits = 0;
+    cache->neg_hits = 0;
+    cache->misses = 0;
+    cache->updates = 0;
+}
+
+void dcache_stat() {
+    struct sfs_dcache *cache = &__sfs->dcache;
+    printf("[dcache] dentries %d/%d hits %d negative hits %d misses %d updates %d\n",
+           cache->nr_dentries, cache->capacity, cache->hits, cache->neg_hits,
+           cache->misses, cache->updates);
+}
+
+static struct sfs_dentry *dcache_find(uint32_t parent, const char *name, uint32_t h) {
+    struct sfs_dentry *d;
+    list_for_each_entry(d, &__sfs->dcache.hash[dcache_hash(parent, h)], hash_list) {
+        if (d->parent == parent && d->hash == h && name_eq(d->name, name)) return d;
+    }
+    return NULL;
+}
+
+// returns 1 and the cached ino (0 for a negative entry) in *ino on a hit
+int dcache_lookup(uint32_t parent, const char *name, uint32_t *ino) {
+    struct sfs_dcache *cache = &__sfs->dcache;
+    struct sfs_dentry *d = dcache_find(parent, name, name_hash(name));
+    if (d == NULL) {
+        cache->misses++;
+        return 0;
+    }
+    if (d->ino) cache->hits++;
+    else cache->neg_hits++;
+    list_move(&d->lru_list, &cache->lru);
+    *ino = d->ino;
+    return 1;
+}
+
+// remember that name in parent is ino, 0 if it does not exist
+void dcache_add(uint32_t parent, const char *name, uint32_t ino) {
+    struct sfs_dcache *cache = &__sfs->dcache;
+    uint32_t h = name_hash(name);
+    uint32_t len = 0;
+    while (name[len]) len++;
+    if (len > SFS_MAX_FILENAME_LEN) return;
+    struct sfs_dentry *d = dcache_find(parent, name, h);
+    if (d == NULL) {
+        if (cache->nr_dentries < cache->capacity) {
+            d = (struct sfs_dentry *)kmalloc(sizeof(struct sfs_dentry));
+            cache->nr_dentries++;
+        } else {
+            d = list_entry(cache->lru.prev, struct sfs_dentry, lru_list);
+            list_del(&d->hash_list);
+            list_del(&d->lru_list);
+        }
+        d->parent = parent;
+        d->hash = h;
+        name_copy(d->name, name);
+        list_add(&d->hash_list, &cache->hash[dcache_hash(parent, h)]);
+        list_add(&d->lru_list, &cache->lru);
+    } else {
+        list_move(&d->lru_list, &cache->lru);
+        cache->updates++;
+    }
+    d->ino = ino;
+}
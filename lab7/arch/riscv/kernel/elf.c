@@ -0,0 +1,163 @@
+#include "elf.h"
+#include "fs.h"
+#include "mm.h"
+#include "slub.h"
+#include "stdio.h"
+#include "task_manager.h"
+#include "vm.h"
+
+// --------------------------------------------------
+// ------------------- ELF Loader -------------------
+// --------------------------------------------------
+// 可执行文件来自 SFS (路径中含 '/') 或 users.S 内置的 initramfs。
+// 只读的 PT_LOAD 段 (text/rodata) 按需映射：SFS 文件用共享的文件映射，
+// 页面就是 buffer cache 中的块；initramfs 中的程序直接映射内核镜像里的页。
+// 两种情况下运行同一程序的所有进程共用同一份只读页。可写的段 (data/bss)
+// 在 exec 时复制到匿名页中，fork 之后写时复制。
+// 段的文件偏移和虚拟地址需要模 PAGE_SIZE 同余，不同的段不能落在同一页中。
+
+int strcmp(const char *a, const char *b);
+
+static bool elf_contains_slash(const char *name) {
+  while (*name) {
+    if (*name++ == '/') return 1;
+  }
+  return 0;
+}
+
+static int elf_read(struct elf_image *img, uint64_t off, void *buf, uint64_t len) {
+  if (img->fd < 0) {
+    if (off > img->size || len > img->size - off) return -1;
+    memcpy(buf, img->data + off, len);
+    return 0;
+  }
+  if (sfs_seek(img->fd, off, SEEK_SET) != 0) return -1;
+  return sfs_read(img->fd, buf, len) == len ? 0 : -1;
+}
+
+int elf_open(struct elf_image *img, const char *name) {
+  img->fd = -1;
+  img->data = NULL;
+  img->size = 0;
+  if (elf_contains_slash(name)) {
+    img->fd = sfs_open(name, SFS_FLAG_READ);
+    if (img->fd < 0) return -1;
+  } else {
+    struct initramfs_entry *e;
+    for (e = initramfs; e->name; e++) {
+      if (strcmp(e->name, name) == 0) break;
+    }
+    if (e->name == NULL) {
+      printf("Unknown user program %s\n", name);
+      return -1;
+    }
+    img->data = e->data;
+    img->size = e->size;
+  }
+
+  Elf64_Ehdr *eh = &img->ehdr;
+  if (elf_read(img, 0, eh, sizeof(Elf64_Ehdr)) != 0 ||
+      *(uint32_t *)eh->e_ident != ELFMAG || eh->e_ident[4] != ELFCLASS64 ||
+      eh->e_type != ET_EXEC || eh->e_machine != EM_RISCV ||
+      eh->e_phentsize != sizeof(Elf64_Phdr) || eh->e_phnum > ELF_MAX_PHDR ||
+      elf_read(img, eh->e_phoff, img->phdr, eh->e_phnum * sizeof(Elf64_Phdr)) != 0) {
+    printf("%s is not an executable\n", name);
+    elf_close(img);
+    return -1;
+  }
+
+  // check the layout before the caller drops the old program
+  uint64_t prev_end = 0;
+  for (int i = 0; i < eh->e_phnum; i++) {
+    Elf64_Phdr *ph = &img->phdr[i];
+    if (ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
+    uint64_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+    uint64_t end = (ph->p_vaddr + ph->p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (ph->p_filesz > ph->p_memsz || ph->p_vaddr + ph->p_memsz < ph->p_vaddr ||
+        start < prev_end || kernel_range(start, end) ||
+        (start < USER_STACK_START + USER_STACK_SIZE && end > USER_STACK_START)) {
+      printf("%s: bad segment at 0x%lx\n", name, ph->p_vaddr);
+      elf_close(img);
+      return -1;
+    }
+    prev_end = end;
+  }
+  return 0;
+}
+
+void elf_close(struct elf_image *img) {
+  if (img->fd >= 0) sfs_close(img->fd);
+  img->fd = -1;
+}
+
+static int elf_perm(Elf64_Phdr *ph) {
+  int perm = PTE_V | PTE_U;
+  if (ph->p_flags & PF_R) perm |= PTE_R;
+  if (ph->p_flags & PF_W) perm |= PTE_R | PTE_W;
+  if (ph->p_flags & PF_X) perm |= PTE_X;
+  return perm;
+}
+
+// read-only segment backed by the file or the initramfs image, faulted in
+// on use. returns 1 if the segment cannot be mapped that way
+static int elf_map_shared(struct elf_image *img, struct mm_struct *mm,
+                          Elf64_Phdr *ph, uint64_t start, uint64_t end) {
+  if ((ph->p_flags & PF_W) || ph->p_filesz != ph->p_memsz ||
+      (ph->p_offset - ph->p_vaddr) % PAGE_SIZE != 0) {
+    return 1;
+  }
+  struct vm_area_struct *vma = kmalloc(sizeof(struct vm_area_struct));
+  if (vma == NULL) return -1;
+  vma->vm_start = start;
+  vma->vm_end = end;
+  vma->vm_flags = elf_perm(ph);
+  vma->vm_ino = 0;
+  vma->vm_offset = 0;
+  vma->vm_shared = 0;
+  vma->vm_image = 0;
+  uint64_t offset = ph->p_offset - (ph->p_vaddr - start);
+  if (img->fd >= 0) {
+    if (sfs_mmap(img->fd, vma, offset, 1) != 0) {
+      kfree(vma);
+      return -1;
+    }
+  } else {
+    vma->vm_image = PHYSICAL_ADDR(img->data + offset);
+  }
+  vma_init(vma);
+  list_add(&vma->vm_list, &mm->vm->vm_list);
+  return 0;
+}
+
+// copy the segment into anonymous pages, the rest of the pages stays zero
+static int elf_map_copy(struct elf_image *img, struct mm_struct *mm, uint64_t *pgtbl,
+                        Elf64_Phdr *ph, uint64_t start, uint64_t end) {
+  struct vm_area_struct *vma = vma_add(mm, start, end - start, elf_perm(ph));
+  if (vma == NULL) return -1;
+  uint64_t file_end = ph->p_vaddr + ph->p_filesz;
+  for (uint64_t va = start; va < end; va += PAGE_SIZE) {
+    if (vma_fault(vma, pgtbl, va, 1) != 0) return -1;
+    uint64_t from = va > ph->p_vaddr ? va : ph->p_vaddr;
+    uint64_t to = va + PAGE_SIZE < file_end ? va + PAGE_SIZE : file_end;
+    if (from >= to) continue;
+    uint64_t pa = (get_pte(pgtbl, va) >> 10) << 12;
+    if (elf_read(img, ph->p_offset + (from - ph->p_vaddr), (void *)(pa + from - va),
+                 to - from) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int elf_map(struct elf_image *img, struct mm_struct *mm, uint64_t *pgtbl) {
+  for (int i = 0; i < img->ehdr.e_phnum; i++) {
+    Elf64_Phdr *ph = &img->phdr[i];
+    if (ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
+    uint64_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+    uint64_t end = (ph->p_vaddr + ph->p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    int ret = elf_map_shared(img, mm, ph, start, end);
+    if (ret == 1) ret = elf_map_copy(img, mm, pgtbl, ph, start, end);
+    if (ret != 0) return -1;
+  }
+  return 0;
+}
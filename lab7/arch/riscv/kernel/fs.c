@@ -7,21 +7,8 @@
 #include "vm.h"
 #include "mm.h"
 
-// --------------------------------------------------
-// ----------- read and write interface -------------
 struct sfs_fs* __sfs;
 
-void disk_op(int blockno, uint8_t *data, bool write) {
-    struct buf b;
-    b.disk = 0;
-    b.blockno = blockno;
-    b.data = (uint8_t *)PHYSICAL_ADDR(data);
-    virtio_disk_rw((struct buf *)(PHYSICAL_ADDR(&b)), write);
-}
-
-#define disk_read(blockno, data) disk_op((blockno), (data), 0)
-#define disk_write(blockno, data) disk_op((blockno), (data), 1)
-
 // --------------------------------------------------
 // ----------------- Tool Functions -----------------
 // --------------------------------------------------
@@ -57,56 +44,6 @@ static int __strcmp(const char *a, const char *b) {
     return -1;
   return 0;
 }
-static uint32_t hash_fn(uint32_t block_num) {
-    return block_num % SFS_BUFFER_SIZE;
-}
-static int hash_insert(mem_block_ptr block) {
-    uint32_t block_num = block->blockno;
-    int idx = hash_fn(block_num);
-    if (__sfs->buffer[idx] == NULL)  { __sfs->buffer[idx] = block; return idx; }
-    if (__sfs->buffer[idx]->blockno == block_num) { return idx; }
-    int start = idx;
-    idx = (idx + 1) % SFS_BUFFER_SIZE;
-    // find a victim
-    while (__sfs->buffer[idx] != NULL && start != idx) {
-        if (__sfs->buffer[idx]->blockno == block_num) {
-            if (__sfs->buffer[idx]->block.block != block->block.block) { printf("error: block not match\n"); }
-            return idx;
-        }
-        else if (__sfs->buffer[idx]->reclaim_count == 0) {
-            // dirty -> write back
-            if (__sfs->buffer[idx]->dirty) { disk_write(__sfs->buffer[idx]->blockno, (uint8_t * )__sfs->buffer[idx]->block.block); }
-            kfree(__sfs->buffer[idx]->block.block);
-            kfree(__sfs->buffer[idx]);
-            __sfs->buffer[idx] = block;
-            return idx;
-        }
-        idx = (idx + 1) % SFS_BUFFER_SIZE;
-    }
-    if (__sfs->buffer[idx] == NULL) {
-        __sfs->buffer[idx] = block;
-        return idx;
-    }
-    // no victim -> use idx
-    // printf("warning: buffer full\n");
-    if (__sfs->buffer[idx]->dirty) { disk_write(__sfs->buffer[idx]->blockno, (uint8_t * )__sfs->buffer[idx]->block.block); }
-    kfree(__sfs->buffer[idx]->block.block);
-    kfree(__sfs->buffer[idx]);
-    __sfs->buffer[idx] = block;
-    return idx;
-}
-static int hash_look_up(uint32_t block_num){
-    int idx = hash_fn(block_num);
-    int start = idx;
-    if (__sfs->buffer[idx] == NULL) return -1;
-    if (__sfs->buffer[idx]->blockno == block_num) return idx;
-    idx = (idx + 1) % SFS_BUFFER_SIZE;
-    while (__sfs->buffer[idx] != NULL && start != idx) {
-        if (__sfs->buffer[idx]->blockno == block_num) return idx;
-        idx = (idx + 1) % SFS_BUFFER_SIZE;
-    }
-    return -1;
-}
 static int min(int a, int b){
     return a < b ? a : b;
 }
@@ -127,130 +64,326 @@ static int next_file_descriptor(){
 // ----------------- Other Functions ----------------
 // --------------------------------------------------
 
-int buffer_update(mem_block_ptr node) {
-    // stupid implementation
-    // do deep copy of the node
-    mem_block_ptr copy = (mem_block_ptr)kmalloc(sizeof(mem_block));
-    memcpy(copy, node, sizeof(mem_block));
-    if (node->is_inode) {
-        copy->block.din = (struct sfs_inode *)kmalloc(sizeof(struct sfs_inode));
-        memcpy(copy->block.din, node->block.din, sizeof(struct sfs_inode));
-    }
-    else {
-        copy->block.block = (char *)kmalloc(sizeof(char) * SFS_BLOCK_SIZE);
-        memcpy(copy->block.block, node->block.block, SFS_BLOCK_SIZE);
-    }
-    int idx = hash_look_up(node->blockno); 
-    // if not in buffer
-    if (idx == -1){
-        return hash_insert(copy);
-    }
-    // if in buffer
-    else {
-        kfree(__sfs->buffer[idx]->block.block); 
-        kfree(__sfs->buffer[idx]);
-        __sfs->buffer[idx] = copy;
-        return idx;
-    }
+static bool sfs_extents(){
+    return __sfs->super.version == SFS_VERSION_EXTENT;
 }
-int set_block_dirty(int block_num){
-    mem_block_ptr ptr;
-    if (get_block_from_buffer(block_num, &ptr)) {
-        ptr->dirty = 1;
-        return 1;
+
+// --------------------------------------------------
+// ---------------- Block Allocation ----------------
+// --------------------------------------------------
+// freemap 按 64 位字扫描，用 ctz 找到字中第一个空闲位。磁盘按 SFS_GROUP_BLOCKS
+// 分组，group_free 记录每组的空闲块数，满的组整组跳过。分配从 goal 开始向后找
+// (文件数据以前一块之后为 goal，保持连续)，没有 goal 时从上次分配的位置继续。
+// 修改过的 freemap 块和超级块在回写时经 buffer cache 写回磁盘。
+
+static const uint8_t ctz_table[64] = {
+    0, 1, 48, 2, 57, 49, 28, 3, 61, 58, 50, 42, 38, 29, 17, 4,
+    62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+    63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+    46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9, 13, 8, 7, 6,
+};
+
+// index of the lowest set bit of x != 0, by de Bruijn multiplication
+// (no libgcc for __builtin_ctzll)
+static int ctz64(uint64_t x){
+    return ctz_table[((x & -x) * 0x03f79d71b4cb0a89ULL) >> 58];
+}
+
+static void freemap_set(uint32_t blockno, bool used){
+    if (used) __sfs->freemap[blockno / 8] |= (1 << (blockno % 8));
+    else __sfs->freemap[blockno / 8] &= ~(1 << (blockno % 8));
+    __sfs->group_free[blockno / SFS_GROUP_BLOCKS] += used ? -1 : 1;
+    __sfs->freemap_dirty[blockno / (SFS_BLOCK_SIZE * 8)] = 1;
+    __sfs->super.unused_blocks += used ? -1 : 1;
+    __sfs->super_dirty = 1;
+}
+
+// first free block in [from, to), 0 if there is none
+static uint32_t freemap_scan(uint32_t from, uint32_t to){
+    uint64_t *words = (uint64_t *)__sfs->freemap;
+    while (from < to) {
+        uint64_t w = ~words[from / 64] & (~0ULL << (from % 64));
+        if (w) {
+            uint32_t blockno = from / 64 * 64 + ctz64(w);
+            return blockno < to ? blockno : 0;
+        }
+        from = (from / 64 + 1) * 64;
     }
     return 0;
 }
-int get_block_from_buffer(uint32_t blockno, struct sfs_memory_block **block) {
-    int idx = hash_look_up(blockno);
-    if (idx == -1) return 0;
-    *block = __sfs->buffer[idx];
-    return 1;
+
+// allocate a free block at or after goal, wrapping around to the start
+// of the disk. goal 0 continues from the last allocation.
+// returns 0 when the disk is full.
+uint32_t next_free_block_near(uint32_t goal){
+    uint32_t blocks = __sfs->super.blocks;
+    uint32_t start = goal ? goal : __sfs->alloc_hint;
+    if (start >= blocks) start = 0;
+    uint32_t g0 = start / SFS_GROUP_BLOCKS;
+    // the last round takes the part of the first group before start
+    for (uint32_t k = 0; k <= __sfs->ngroups; k++) {
+        uint32_t g = (g0 + k) % __sfs->ngroups;
+        if (__sfs->group_free[g] == 0) continue;
+        uint32_t from = k == 0 ? start : g * SFS_GROUP_BLOCKS;
+        uint32_t to = k == __sfs->ngroups ? start : min((g + 1) * SFS_GROUP_BLOCKS, blocks);
+        uint32_t blockno = freemap_scan(from, to);
+        if (blockno == 0) continue;
+        freemap_set(blockno, 1);
+        __sfs->alloc_hint = blockno + 1;
+        return blockno;
+    }
+    return 0;
 }
+
 int next_free_block(){
-    for (int i = 0; i < __sfs->super.blocks; i++) {
-        if (!(__sfs->freemap[i / 8] & (1 << (i % 8)))) {
-            __sfs->freemap[i / 8] |= (1 << (i % 8));
-            __sfs->super.unused_blocks--;
-            __sfs->super_dirty = 1;
-            return i;
+    return next_free_block_near(0);
+}
+// give a block back to the freemap
+void release_block(uint32_t blockno){
+    if (blockno == 0 || SFS_IS_DELALLOC(blockno)) return;
+    freemap_set(blockno, 0);
+}
+
+// the goal for block idx of a file: right after its block idx - 1.
+// with nowait only mappings readable without I/O are used.
+uint32_t block_goal(struct sfs_inode * inode, uint32_t idx, bool nowait){
+    if (idx == 0 || idx > inode->blocks) return 0;
+    if (nowait && (sfs_extents() ? inode->depth != 0 : idx - 1 >= SFS_NDIRECT)) return 0;
+    uint32_t prev = block_from_idx(inode, idx - 1);
+    if (prev == 0 || SFS_IS_DELALLOC(prev)) return 0;
+    return prev + 1;
+}
+
+// copy the superblock and dirty freemap blocks into the buffer, the
+// buffer writes them back. with nowait only cached blocks are updated,
+// the rest waits for a later call.
+void sfs_sync_super(bool nowait){
+    if (!__sfs->super_dirty) return;
+    bool pending = 0;
+    for (int i = -1; i < (int)__sfs->freemap_blocks; i++) {
+        if (i >= 0 && !__sfs->freemap_dirty[i]) continue;
+        uint32_t blockno = i < 0 ? 0 : 2 + i;
+        uint8_t *buf = nowait ? peek_block(blockno) : buffer_new_block(blockno, 0);
+        if (buf == NULL) {
+            pending = 1;
+            continue;
         }
+        if (i < 0) memcpy(buf, &__sfs->super, sizeof(struct sfs_super));
+        else {
+            memcpy(buf, __sfs->freemap + i * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE);
+            __sfs->freemap_dirty[i] = 0;
+        }
+        set_block_dirty(blockno);
     }
-    return 0;
+    __sfs->super_dirty = pending;
+}
+
+// --------------------------------------------------
+// ------------------- Block Map --------------------
+// --------------------------------------------------
+// 文件块号 -> 磁盘块号。旧格式使用 11 个直接块和 1 个间接块；
+// SFS_VERSION_EXTENT 格式使用 extent：inode 中最多 SFS_NEXTENT 个 extent，
+// 放不下时 (depth 1) inode 中改为存放叶子块的索引，每个叶子块存放 SFS_LEAF_NEXTENT 个。
+// 查找只需在有序数组上二分。
+
+// a metadata block. with nowait only a cached, idle block is returned,
+// NULL instead of sleeping on the disk.
+static uint8_t *map_block(uint32_t blockno, bool nowait){
+    return nowait ? peek_block(blockno) : read_block(blockno, 0);
 }
-uint8_t *read_block(uint32_t blockno, bool is_inode){
-    // try to get from buffer
-    mem_block_ptr ptr;
-    if (get_block_from_buffer(blockno, &ptr)) {
-        return ptr->block.block;
-    }
-    // read from disk
-    else { 
-        uint8_t *buf = (uint8_t *)kmalloc(sizeof(uint8_t) * SFS_BLOCK_SIZE);
-        disk_read(blockno, buf); 
-        // insert into buffer
-        mem_block_ptr node = (mem_block_ptr)kmalloc(sizeof(mem_block));
-        node->blockno = blockno;
-        node->is_inode = is_inode;
-        node->dirty = 0;
-        node->reclaim_count = 0;
-        node->block.block = buf;
-        hash_insert(node);
-        return buf;
-    } 
-}
-int write_block(uint32_t blockno, bool is_inode, uint8_t *buf){
-    // try to get from buffer
-    // buf should be from buffer
-    mem_block_ptr ptr;
-    if (get_block_from_buffer(blockno, &ptr)) {
-        if (ptr->block.block != buf){
-            printf("error, block addr = %x, buf addr = %x\n", ptr->block.block, buf);
-            while(1);
-        }
-        ptr->dirty = 1;
-        return 0; // indicate a write hit, no need to write to disk and buf can't be freed by caller
-    }
-    // write to disk
+
+// index of the last extent with lblk <= idx, -1 if there is none
+static int extent_search(struct sfs_extent *ext, uint32_t n, uint32_t idx){
+    int lo = 0, hi = (int)n - 1, ans = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ext[mid].lblk <= idx) { ans = mid; lo = mid + 1; }
+        else hi = mid - 1;
+    }
+    return ans;
+}
+
+static void extent_insert(struct sfs_extent *ext, uint32_t *n, int pos, uint32_t lblk, uint32_t start, uint32_t len){
+    for (int i = *n; i > pos; i--) ext[i] = ext[i - 1];
+    ext[pos].lblk = lblk;
+    ext[pos].start = start;
+    ext[pos].len = len;
+    (*n)++;
+}
+
+static void extent_remove(struct sfs_extent *ext, uint32_t *n, int pos){
+    for (int i = pos; i + 1 < *n; i++) ext[i] = ext[i + 1];
+    (*n)--;
+}
+
+// map block idx to blockno in a sorted extent array, splitting the extent
+// that covered idx and merging with contiguous neighbours. needs room for
+// two more entries.
+static void extent_set(struct sfs_extent *ext, uint32_t *n, uint32_t idx, uint32_t blockno){
+    int i = extent_search(ext, *n, idx);
+    int pos = i + 1;
+    if (i >= 0 && idx < ext[i].lblk + ext[i].len) {
+        struct sfs_extent e = ext[i];
+        uint32_t off = idx - e.lblk;
+        if (e.start + off == blockno) return;
+        extent_remove(ext, n, i);
+        pos = i;
+        if (off > 0) extent_insert(ext, n, pos++, e.lblk, e.start, off);
+        if (off + 1 < e.len) extent_insert(ext, n, pos, idx + 1, e.start + off + 1, e.len - off - 1);
+    }
+    if (pos > 0 && ext[pos - 1].lblk + ext[pos - 1].len == idx && ext[pos - 1].start + ext[pos - 1].len == blockno) {
+        ext[--pos].len++;
+    }
     else {
-        // buf is not persistent
-        // so do copy here
-        mem_block_ptr node = (mem_block_ptr)kmalloc(sizeof(mem_block));
-        node->blockno = blockno;
-        node->is_inode = is_inode;
-        node->dirty = 1;
-        node->reclaim_count = 0;
-        node->block.block = (uint8_t *)kmalloc(sizeof(uint8_t) * SFS_BLOCK_SIZE);
-        memcpy(node->block.block, buf, SFS_BLOCK_SIZE);
-        hash_insert(node);
-        return 1; // indicate a write miss and buf can be freed by caller
+        extent_insert(ext, n, pos, idx, blockno, 1);
+    }
+    if (pos + 1 < *n && ext[pos].lblk + ext[pos].len == ext[pos + 1].lblk &&
+        ext[pos].start + ext[pos].len == ext[pos + 1].start) {
+        ext[pos].len += ext[pos + 1].len;
+        extent_remove(ext, n, pos + 1);
     }
 }
-uint32_t allocate_block_from_idx(struct sfs_inode * inode, int block_idx){
+
+// map block idx of an extent inode to blockno. grows the tree when the
+// extents do not fit, which allocates blocks and so never happens with
+// nowait. returns 0 on success.
+static int extent_map(struct sfs_inode * inode, uint32_t idx, uint32_t blockno, bool nowait){
+    if (inode->depth == 0) {
+        if (inode->nextents + 2 <= SFS_NEXTENT) {
+            extent_set(inode->ext, &inode->nextents, idx, blockno);
+            return 0;
+        }
+        if (nowait) return -1;
+        // move the extents into a leaf, the inode keeps one index entry
+        uint32_t leafno = next_free_block();
+        if (leafno == 0) return -1;
+        struct sfs_extent_leaf *leaf = (struct sfs_extent_leaf *)buffer_new_block(leafno, 0);
+        if (leaf == NULL) {
+            release_block(leafno);
+            return -1;
+        }
+        leaf->nextents = inode->nextents;
+        memcpy(leaf->ext, inode->ext, inode->nextents * sizeof(struct sfs_extent));
+        inode->depth = 1;
+        inode->nextents = 1;
+        inode->ext[0].lblk = 0;
+        inode->ext[0].start = leafno;
+        inode->ext[0].len = 0;
+    }
+    int i = extent_search(inode->ext, inode->nextents, idx);
+    if (i < 0) i = 0;
+    uint32_t leafno = inode->ext[i].start;
+    struct sfs_extent_leaf *leaf = (struct sfs_extent_leaf *)map_block(leafno, nowait);
+    if (leaf == NULL) return -1;
+    if (leaf->nextents + 2 > SFS_LEAF_NEXTENT) {
+        if (nowait || inode->nextents == SFS_NEXTENT) return -1;
+        // split the leaf in half
+        uint32_t newno = next_free_block();
+        if (newno == 0) return -1;
+        reclaim_block(leafno);
+        struct sfs_extent_leaf *upper = (struct sfs_extent_leaf *)buffer_new_block(newno, 0);
+        if (upper == NULL) {
+            recycle_block(leafno);
+            release_block(newno);
+            return -1;
+        }
+        uint32_t half = leaf->nextents / 2;
+        upper->nextents = leaf->nextents - half;
+        memcpy(upper->ext, leaf->ext + half, upper->nextents * sizeof(struct sfs_extent));
+        leaf->nextents = half;
+        set_block_dirty(leafno);
+        recycle_block(leafno);
+        extent_insert(inode->ext, &inode->nextents, i + 1, upper->ext[0].lblk, newno, 0);
+        return extent_map(inode, idx, blockno, nowait);
+    }
+    extent_set(leaf->ext, &leaf->nextents, idx, blockno);
+    // the first key may have moved down, the index must still cover it
+    if (leaf->ext[0].lblk < inode->ext[i].lblk) inode->ext[i].lblk = leaf->ext[0].lblk;
+    set_block_dirty(leafno);
+    return 0;
+}
+
+// map block block_idx of a file to blockno. idx is either mapped already
+// (delayed allocation replacing its pseudo blockno) or inode->blocks, the
+// caller counts the new block. the caller marks the inode dirty.
+// returns 0 on success, non-zero when the file cannot grow or nowait
+// would have to sleep.
+int set_block_idx(struct sfs_inode * inode, uint32_t block_idx, uint32_t blockno, bool nowait){
+    if (sfs_extents()) return extent_map(inode, block_idx, blockno, nowait);
     if (block_idx < SFS_NDIRECT) {
-        uint32_t blockno = next_free_block();
         inode->direct[block_idx] = blockno;
-        inode->blocks++;
-        return blockno;
+        return 0;
+    }
+    if (block_idx >= SFS_NDIRECT + SFS_NINDIRECT) return -1;
+    uint8_t *buf;
+    if (inode->indirect == 0) {
+        if (nowait) return -1;
+        inode->indirect = next_free_block();
+        buf = buffer_new_block(inode->indirect, 0);
+        if (buf == NULL) {
+            release_block(inode->indirect);
+            inode->indirect = 0;
+            return -1;
+        }
     }
     else {
-        uint8_t *buf;
-        if (inode->indirect == 0) {
-            inode->indirect = next_free_block();
-            buf = read_block(inode->indirect, 0);
-            reset_buffer(buf);
-            write_block(inode->indirect, 0, buf);
-        }
-        else { buf = read_block(inode->indirect, 0); }
-        uint32_t *indirect_block = (uint32_t *)buf;
-        uint32_t blockno = next_free_block();
-        indirect_block[block_idx - SFS_NDIRECT] = blockno;
-        write_block(inode->indirect, 0, buf);
-        inode->blocks++;
-        return blockno;
+        buf = map_block(inode->indirect, nowait);
+        if (buf == NULL) return -1;
+    }
+    uint32_t *indirect_block = (uint32_t *)buf;
+    indirect_block[block_idx - SFS_NDIRECT] = blockno;
+    set_block_dirty(inode->indirect);
+    return 0;
+}
+// a fresh inode of the given type, without blocks
+void inode_init(struct sfs_inode * inode, uint16_t type){
+    memset(inode, 0, sizeof(struct sfs_inode));
+    inode->type = type;
+    inode->links = 1;
+}
+uint32_t allocate_block_from_idx(struct sfs_inode * inode, int block_idx){
+    uint32_t blockno = next_free_block_near(block_goal(inode, block_idx, 0));
+    if (blockno == 0) return 0;
+    if (set_block_idx(inode, block_idx, blockno, 0) != 0) {
+        release_block(blockno);
+        return 0;
     }
+    inode->blocks++;
+    return blockno;
+}
+// like allocate_block_from_idx, but the data block only gets a pseudo
+// blockno in the buffer, the real one is chosen at write back
+// (buffer_allocate_delayed). map blocks (indirect, extent leaves) are
+// still allocated here.
+uint32_t delalloc_block_from_idx(uint32_t ino, struct sfs_inode * inode, int block_idx){
+    uint32_t blockno = buffer_delalloc(ino, block_idx);
+    if (blockno == 0) return 0;
+    if (set_block_idx(inode, block_idx, blockno, 0) != 0) {
+        buffer_drop(blockno);
+        return 0;
+    }
+    inode->blocks++;
+    return blockno;
 }
 uint32_t block_from_idx(struct sfs_inode * inode, int block_idx){
+    if (sfs_extents()) {
+        struct sfs_extent *ext = inode->ext;
+        uint32_t n = inode->nextents;
+        if (inode->depth == 1) {
+            int i = extent_search(ext, n, block_idx);
+            if (i < 0) return 0;
+            struct sfs_extent_leaf *leaf = (struct sfs_extent_leaf *)read_block(ext[i].start, 0);
+            if (leaf == NULL) return 0;
+            ext = leaf->ext;
+            n = leaf->nextents;
+        }
+        int i = extent_search(ext, n, block_idx);
+        if (i < 0 || block_idx >= ext[i].lblk + ext[i].len) {
+            printf("error: block %d not mapped\n", block_idx);
+            return 0;
+        }
+        return ext[i].start + (block_idx - ext[i].lblk);
+    }
     if (block_idx < SFS_NDIRECT) {
         return inode->direct[block_idx];
     }
@@ -259,24 +392,383 @@ uint32_t block_from_idx(struct sfs_inode * inode, int block_idx){
             printf("error: indirect block not found\n");
             return 0;
         }
-        uint8_t *buf = read_block(inode->indirect, 0);
-        uint32_t *indirect_block = (uint32_t *)buf;
-        uint32_t ino = indirect_block[block_idx - SFS_NDIRECT];
-        write_block(inode->indirect, 0, buf);
-        return ino;
+        uint32_t *indirect_block = (uint32_t *)read_block(inode->indirect, 0);
+        if (indirect_block == NULL) return 0;
+        return indirect_block[block_idx - SFS_NDIRECT];
+    }
+}
+// read blocks [from, to] of a file into the buffer, SFS_MAX_RUN at a time.
+// blocks adjacent on disk are read with one request.
+static void prefetch_file_blocks(struct sfs_inode * inode, uint32_t from, uint32_t to){
+    uint32_t blocknos[SFS_MAX_RUN];
+    while (from <= to && from < inode->blocks) {
+        int n = 0;
+        for (; from <= to && from < inode->blocks && n < SFS_MAX_RUN; from++) {
+            blocknos[n++] = block_from_idx(inode, from);
+        }
+        buffer_prefetch(blocknos, n, 0);
+    }
+}
+// size of the first window for a sequential read of req blocks, as in
+// linux: small reads start at 4x, medium at 2x, large at the maximum.
+static uint32_t init_ra_size(uint32_t req){
+    uint32_t size = 1;
+    while (size < req) size <<= 1;
+    if (size <= SFS_RA_MAX / 32) size *= 4;
+    else if (size <= SFS_RA_MAX / 4) size *= 2;
+    else size = SFS_RA_MAX;
+    return size;
+}
+// read-ahead before block of file f is read, last is the final block of the
+// current request. a sequential miss opens a window, reaching the marker
+// inside the window reads the next window (twice as big) ahead of time, a
+// random access only reads the request itself.
+static void file_readahead(struct file * f, uint32_t block, uint32_t last){
+    uint32_t ra_end = f->ra_start + f->ra_size;
+    if (f->ra_size > 0 && block >= f->ra_start && block < ra_end) {
+        if (block != ra_end - f->ra_async_size) return;
+        f->ra_start = ra_end;
+        f->ra_size = min(f->ra_size * (f->ra_size < SFS_RA_MAX / 16 ? 4 : 2), SFS_RA_MAX);
+        f->ra_async_size = f->ra_size;
+    }
+    else if (block == f->ra_prev) {
+        uint32_t req = last - block + 1;
+        f->ra_start = block;
+        f->ra_size = init_ra_size(req);
+        f->ra_async_size = f->ra_size > req ? f->ra_size - req : 0;
+    }
+    else {
+        f->ra_size = 0;
+        prefetch_file_blocks(f->inode, block, min(last, block + SFS_MAX_RUN - 1));
+        return;
+    }
+    prefetch_file_blocks(f->inode, f->ra_start, f->ra_start + f->ra_size - 1);
+}
+// --------------------------------------------------
+// ------------------- Direct I/O -------------------
+// --------------------------------------------------
+// 以 SFS_FLAG_DIRECT 打开的文件，从块边界开始的整块读写不经过缓存：
+// 通过任务的页表把用户缓冲区翻译成物理段，磁盘直接对其 DMA。
+// 内核中任务不会被换出，翻译得到的页在请求期间一直有效。
+// 仍在缓存中的块 (可能是脏块或延迟分配的块) 以缓存为准，照常拷贝。
+
+// physical segments for len bytes of user memory at va, merged where the
+// pages are contiguous. for a read the device writes them, so they need
+// PTE_W. returns the number of segments, -1 if a page is not mapped or
+// more than max segments are needed.
+static int user_segs(uint64_t va, uint32_t len, bool to_user, struct buf_seg *seg, int max){
+    uint64_t *root = (uint64_t *)((current->satp & ((1ULL << 44) - 1)) << 12);
+    uint64_t need = PTE_V | PTE_U | (to_user ? PTE_W : PTE_R);
+    int n = 0;
+    while (len > 0) {
+        uint64_t pte = get_pte(root, va);
+        if ((pte & need) != need) return -1;
+        uint8_t *pa = (uint8_t *)(((pte >> 10) << 12) + (va & (PAGE_SIZE - 1)));
+        uint32_t chunk = min(len, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+        if (n > 0 && seg[n - 1].addr + seg[n - 1].len == pa) seg[n - 1].len += chunk;
+        else {
+            if (n == max) return -1;
+            seg[n].addr = pa;
+            seg[n].len = chunk;
+            n++;
+        }
+        va += chunk;
+        len -= chunk;
+    }
+    return n;
+}
+
+// move n whole blocks of f, from block first on, between the disk and
+// user memory at buf. blocks past the end of the file are allocated for
+// a write. returns the number of blocks done, the caller finishes the
+// rest through the buffer.
+static uint32_t file_direct_io(struct file * f, char * buf, uint32_t first, uint32_t n, bool write){
+    struct sfs_inode * inode = f->inode;
+    struct buf_seg seg[BUF_MAX_SEG];
+    uint32_t done = 0;
+    while (done < n) {
+        uint32_t blockno;
+        uint32_t run = 0;
+        // a run of uncached blocks that are consecutive on disk
+        while (done + run < n && run < SFS_MAX_RUN) {
+            uint32_t idx = first + done + run;
+            uint32_t b = idx < inode->blocks ? block_from_idx(inode, idx) : (write ? allocate_block_from_idx(inode, idx) : 0);
+            if (b == 0 || buffer_cached(b) || (run > 0 && b != blockno + run)) break;
+            if (run == 0) blockno = b;
+            run++;
+        }
+        if (run == 0) {
+            uint32_t idx = first + done;
+            if (idx >= inode->blocks) break;
+            blockno = block_from_idx(inode, idx);
+            if (!buffer_cached(blockno)) break;
+            // the cached copy is the current one
+            uint8_t *block_buf = read_block(blockno, 0);
+            if (write) {
+                memcpy(block_buf, buf + done * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE);
+                write_block(blockno, 0, block_buf);
+            }
+            else memcpy(buf + done * SFS_BLOCK_SIZE, block_buf, SFS_BLOCK_SIZE);
+            done++;
+            continue;
+        }
+        int nseg = user_segs((uint64_t)buf + done * SFS_BLOCK_SIZE, run * SFS_BLOCK_SIZE, !write, seg, BUF_MAX_SEG);
+        if (nseg < 0 || disk_direct_io(blockno, seg, nseg, write) != 0) break;
+        __sfs->buffer.direct += run;
+        done += run;
+    }
+    return done;
+}
+
+// --------------------------------------------------
+// ------------------ File Mapping ------------------
+// --------------------------------------------------
+// 共享映射直接把缓存块 (按页对齐的一整页) 映射给用户，映射期间块被 pin 住不会被换出；
+// 页面先以只读映射，第一次写缺页时把块标脏并开放写权限。munmap 时写过的块被写回。
+// 私有映射在缺页时拷贝一份，fork 之后父子进程写时复制共享这些页。映射期间文件的 inode 也被 pin 住。
+
+int sfs_mmap(int fd, struct vm_area_struct *vma, uint64_t offset, bool shared){
+    sfs_init();
+    if (fd < 0 || fd >= 16 || current->fs.fds[fd] == NULL) return -1;
+    if (offset % PAGE_SIZE != 0) return -1;
+    if (shared && (vma->vm_flags & PTE_W) && !(current->fs.fds[fd]->flags & SFS_FLAG_WRITE)) return -1;
+    if (read_block(current->fs.fds[fd]->inode_blockno, 1) == NULL) return -1;
+    vma->vm_ino = current->fs.fds[fd]->inode_blockno;
+    vma->vm_offset = offset;
+    vma->vm_shared = shared;
+    reclaim_block(vma->vm_ino);
+    return 0;
+}
+
+uint64_t sfs_fault(struct vm_area_struct *vma, uint64_t va, bool write, int *perm){
+    struct sfs_inode * inode = (struct sfs_inode *)read_block(vma->vm_ino, 1);
+    uint32_t idx = (vma->vm_offset + (va & ~(PAGE_SIZE - 1)) - vma->vm_start) / SFS_BLOCK_SIZE;
+    if (idx >= inode->blocks) return 0;
+    uint32_t blockno = block_from_idx(inode, idx);
+    if (blockno == 0) return 0;
+    uint8_t *buf = read_block(blockno, 0);
+    if (buf == NULL) return 0;
+    *perm = vma->vm_flags;
+    if (!vma->vm_shared) {
+        // keep the buffer while the copy is allocated and filled
+        reclaim_block(blockno);
+        uint64_t pa = alloc_pages_flags(1, ALLOC_NOZERO);
+        if (pa != 0) memcpy((void *)pa, buf, PAGE_SIZE);
+        recycle_block(blockno);
+        return pa;
+    }
+    uint64_t *pgtbl = (uint64_t *)((current->satp & ((1ULL << 44) - 1)) << 12);
+    // a page already present is only upgraded for writing, it holds its pin
+    if (!(get_pte(pgtbl, va) & PTE_V)) reclaim_block(blockno);
+    if (write) set_block_dirty(blockno);
+    else *perm &= ~PTE_W;
+    return PHYSICAL_ADDR(buf);
+}
+
+void sfs_munmap(struct vm_area_struct *vma, uint64_t *pgtbl){
+    struct sfs_inode * inode = (struct sfs_inode *)read_block(vma->vm_ino, 1);
+    for (uint64_t va = vma->vm_start; va < vma->vm_end; va += PAGE_SIZE) {
+        uint64_t pte = get_pte(pgtbl, va);
+        if (!(pte & PTE_V)) continue;
+        if (!vma->vm_shared) {
+            // a private copy may be shared copy-on-write after fork
+            uint64_t pa = (pte >> 10) << 12;
+            if (page_ref_dec(pa)) free_pages(pa);
+            continue;
+        }
+        uint32_t blockno = block_from_idx(inode, (vma->vm_offset + va - vma->vm_start) / SFS_BLOCK_SIZE);
+        // stores after the first one are not seen, a writable page may hold any of them
+        if (pte & PTE_W) {
+            set_block_dirty(blockno);
+            blockno = buffer_flush_block(blockno);
+        }
+        recycle_block(blockno);
+    }
+    recycle_block(vma->vm_ino);
+    vma->vm_ino = 0;
+}
+
+// --------------------------------------------------
+// ---------------- Directory Index -----------------
+// --------------------------------------------------
+// 目录项超过一个块后为目录建立哈希索引 (可扩展哈希，类似 ext4 htree)：
+// 查找和插入只需读索引根块、一个桶和目录项所在的块。桶满时分裂，
+// 局部深度等于全局深度时根块中的桶指针先翻倍。目录项仍线性存放，
+// 索引放不下 (哈希全部相同或深度用完) 时丢弃索引，退回线性扫描。
+
+// FNV-1a
+uint32_t name_hash(const char *name){
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// entry k of directory din, NULL when its block cannot be read
+static struct sfs_entry *dir_entry(struct sfs_inode * din, uint32_t k){
+    int num_entries_each = SFS_BLOCK_SIZE / sizeof(struct sfs_entry);
+    uint32_t blockno = block_from_idx(din, k / num_entries_each);
+    uint8_t *buf = blockno == 0 ? NULL : read_block(blockno, 0);
+    if (buf == NULL) return NULL;
+    return (struct sfs_entry *)buf + k % num_entries_each;
+}
+
+// an index that missed entries (e.g. added by a kernel without indexes)
+// must not be used
+static bool dir_index_valid(struct sfs_inode * din){
+    if (!sfs_extents() || din->dir_index == 0) return 0;
+    struct sfs_dir_root *root = (struct sfs_dir_root *)read_block(din->dir_index, 0);
+    if (root == NULL) return 0;
+    return root->nentries == din->size / sizeof(struct sfs_entry);
+}
+
+static uint32_t dir_index_find(struct sfs_inode * din, const char *name){
+    uint32_t h = name_hash(name);
+    struct sfs_dir_root *root = (struct sfs_dir_root *)read_block(din->dir_index, 0);
+    if (root == NULL) return SFS_NO_BUFFER;
+    uint32_t bucketno = root->bucket[h & ((1u << root->depth) - 1)];
+    struct sfs_dir_bucket *bucket = (struct sfs_dir_bucket *)read_block(bucketno, 0);
+    if (bucket == NULL) return SFS_NO_BUFFER;
+    reclaim_block(bucketno);
+    uint32_t ino = 0;
+    for (int i = 0; i < bucket->count && ino == 0; i++) {
+        if (bucket->e[i].hash != h) continue;
+        struct sfs_entry *entry = dir_entry(din, bucket->e[i].slot);
+        if (entry == NULL) ino = SFS_NO_BUFFER;
+        else if (__strcmp(entry->filename, name) == 0) ino = entry->ino;
     }
+    recycle_block(bucketno);
+    return ino;
 }
+
+// free the index blocks of din, the directory is scanned linearly again
+static void dir_index_drop(struct sfs_inode * din){
+    if (din->dir_index == 0) return;
+    struct sfs_dir_root *root = (struct sfs_dir_root *)read_block(din->dir_index, 0);
+    // kept, dir_index_valid() fails on it just the same
+    if (root == NULL) return;
+    reclaim_block(din->dir_index);
+    for (uint32_t i = 0; i < (1u << root->depth); i++) {
+        // a bucket is shared by several pointers, free it at the first one
+        uint32_t j = 0;
+        while (j < i && root->bucket[j] != root->bucket[i]) j++;
+        if (j < i) continue;
+        buffer_drop(root->bucket[i]);
+        release_block(root->bucket[i]);
+    }
+    recycle_block(din->dir_index);
+    buffer_drop(din->dir_index);
+    release_block(din->dir_index);
+    din->dir_index = 0;
+}
+
+// add (h, slot) to the index of din, splitting full buckets.
+// returns 0 on success, -1 when the entry does not fit.
+static int dir_index_insert(struct sfs_inode * din, uint32_t h, uint32_t slot){
+    uint32_t rootno = din->dir_index;
+    struct sfs_dir_root *root = (struct sfs_dir_root *)read_block(rootno, 0);
+    if (root == NULL) return -1;
+    reclaim_block(rootno);
+    int ret = 0;
+    while (1) {
+        uint32_t bucketno = root->bucket[h & ((1u << root->depth) - 1)];
+        struct sfs_dir_bucket *bucket = (struct sfs_dir_bucket *)read_block(bucketno, 0);
+        if (bucket == NULL) { ret = -1; break; }
+        if (bucket->count < SFS_DIR_BUCKET_NR) {
+            bucket->e[bucket->count].hash = h;
+            bucket->e[bucket->count].slot = slot;
+            bucket->count++;
+            set_block_dirty(bucketno);
+            root->nentries++;
+            break;
+        }
+        if (bucket->depth == root->depth) {
+            if (root->depth == SFS_DIR_MAX_DEPTH) { ret = -1; break; }
+            for (uint32_t i = 0; i < (1u << root->depth); i++) root->bucket[i + (1u << root->depth)] = root->bucket[i];
+            root->depth++;
+        }
+        uint32_t newno = next_free_block();
+        if (newno == 0) { ret = -1; break; }
+        reclaim_block(bucketno);
+        struct sfs_dir_bucket *upper = (struct sfs_dir_bucket *)buffer_new_block(newno, 0);
+        if (upper == NULL) {
+            recycle_block(bucketno);
+            release_block(newno);
+            ret = -1;
+            break;
+        }
+        uint32_t bit = 1u << bucket->depth;
+        bucket->depth++;
+        upper->depth = bucket->depth;
+        int n = 0;
+        for (int i = 0; i < bucket->count; i++) {
+            if (bucket->e[i].hash & bit) upper->e[upper->count++] = bucket->e[i];
+            else bucket->e[n++] = bucket->e[i];
+        }
+        bucket->count = n;
+        for (uint32_t i = 0; i < (1u << root->depth); i++) {
+            if (root->bucket[i] == bucketno && (i & bit)) root->bucket[i] = newno;
+        }
+        set_block_dirty(bucketno);
+        recycle_block(bucketno);
+    }
+    set_block_dirty(rootno);
+    recycle_block(rootno);
+    return ret;
+}
+
+// index every entry of din. returns 0 on success.
+static int dir_index_build(struct sfs_inode * din){
+    uint32_t rootno = next_free_block();
+    uint32_t bucketno = next_free_block();
+    if (rootno == 0 || bucketno == 0) {
+        release_block(rootno);
+        release_block(bucketno);
+        return -1;
+    }
+    struct sfs_dir_root *root = (struct sfs_dir_root *)buffer_new_block(rootno, 0);
+    if (root == NULL || buffer_new_block(bucketno, 0) == NULL) {
+        buffer_drop(rootno);
+        release_block(rootno);
+        release_block(bucketno);
+        return -1;
+    }
+    root->bucket[0] = bucketno;
+    din->dir_index = rootno;
+    uint32_t n = din->size / sizeof(struct sfs_entry);
+    for (uint32_t k = 0; k < n; k++) {
+        struct sfs_entry *entry = dir_entry(din, k);
+        if (entry == NULL || dir_index_insert(din, name_hash(entry->filename), k) != 0) {
+            dir_index_drop(din);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the inode of name in dir_inode, 0 if there is none, SFS_NO_BUFFER when
+// the directory could not be read
 uint32_t find_in_dir(uint32_t dir_inode,const char * name){
     // get dir inode
     uint8_t *__dir = read_block(dir_inode, 1);
+    if (__dir == NULL) return SFS_NO_BUFFER;
     struct sfs_inode * din = (struct sfs_inode *)__dir;
+    if (dir_index_valid(din)) {
+        reclaim_block(dir_inode);
+        uint32_t ino = dir_index_find(din, name);
+        recycle_block(dir_inode);
+        return ino;
+    }
     // search in dir
     uint8_t *buf;
     uint32_t num_entries = din->size / 32;
     int num_entries_each = SFS_BLOCK_SIZE / sizeof(struct sfs_entry);
     for (int i = 0; i < din->blocks; i++) {
         uint32_t block_number = block_from_idx(din, i);
-        buf = read_block(block_number, 1);
+        buf = block_number == 0 ? NULL : read_block(block_number, 1);
+        if (buf == NULL) return SFS_NO_BUFFER;
         struct sfs_entry *entry = (struct sfs_entry *)buf;
         if (i == din->blocks - 1) num_entries_each = num_entries - i * num_entries_each;
         for (int j = 0; j < num_entries_each; j++) {
@@ -288,181 +780,151 @@ uint32_t find_in_dir(uint32_t dir_inode,const char * name){
     }
     return 0;
 }
-void register_entry(uint32_t dir_inode, char * filename, uint32_t fino){
+// find_in_dir through the dentry cache, misses (also negative ones) are
+// remembered. a directory that could not be read is not a miss.
+static uint32_t lookup(uint32_t dir_inode, const char *name){
+    uint32_t ino;
+    if (dcache_lookup(dir_inode, name, &ino)) return ino;
+    ino = find_in_dir(dir_inode, name);
+    if (ino != SFS_NO_BUFFER) dcache_add(dir_inode, name, ino);
+    return ino;
+}
+// returns 0 on success
+int register_entry(uint32_t dir_inode, char * filename, uint32_t fino){
     // check if dir exists
-    uint32_t ino = find_in_dir(dir_inode, filename);
+    uint32_t ino = lookup(dir_inode, filename);
     if (ino != 0) {
-        printf("dir exists\n");
-        return ;
+        if (ino != SFS_NO_BUFFER) printf("dir exists\n");
+        return -1;
     }
-    // get dir inode
-    uint8_t *__dir = read_block(dir_inode, 1);
-    struct sfs_inode * din = (struct sfs_inode *)__dir;
-    // update dir
-    uint8_t *buf = (uint8_t *)kmalloc(sizeof(uint8_t) * SFS_BLOCK_SIZE);
-    int block_limit = (SFS_BLOCK_SIZE / sizeof(struct sfs_entry)) * SFS_NDIRECT;
-    // 1. within direct blocks
-    if (din->size < block_limit) {
-        int num_entries = din->size / 32;  
-        int num_entries_each = SFS_BLOCK_SIZE / sizeof(struct sfs_entry);
-        // 1.1 need a new block
-        if ((num_entries + 1) % num_entries_each == 0) {
-            din->direct[din->blocks] = next_free_block();
-            buf = read_block(din->direct[din->blocks], 0);
-            struct sfs_entry *entry = (struct sfs_entry *)buf;
-            entry[0].ino = fino;
-            __strcpy(entry[0].filename, filename);
-            write_block(din->direct[din->blocks], 0, buf);
-            din->blocks++;
-        }
-        // 1.2 within a block 
-        else {
-            buf = read_block(din->direct[din->blocks - 1], 0);
-            struct sfs_entry *entry = (struct sfs_entry *)buf;
-            int idx = num_entries % num_entries_each;
-            entry[idx].ino = fino;
-            __strcpy(entry[idx].filename, filename);
-            write_block(din->direct[din->blocks - 1], 0, buf);
-        }
-        
-    }
-    // 2. need indirect block
-    else if (din->size == block_limit) {
-        din->indirect = next_free_block();
-        buf = read_block(din->indirect, 0);
-        reset_buffer(buf);
-        uint32_t *indirect_block = (uint32_t *)buf; 
-        uint32_t next_block = next_free_block();
-        indirect_block[0] = next_block;
-        write_block(din->indirect, 0, buf);
-        // write new block
-        buf = read_block(next_block, 0);
-        reset_buffer(buf);
-        struct sfs_entry *entry = (struct sfs_entry *)buf;
-        entry[0].ino = fino;
-        __strcpy(entry[0].filename, filename);
-        write_block(next_block, 0, buf);
-        din->blocks++;
+    // get dir inode, pinned while the entry block is read
+    struct sfs_inode * din = (struct sfs_inode *)read_block(dir_inode, 1);
+    if (din == NULL) return -1;
+    reclaim_block(dir_inode);
+    // entry k lives in block k / num_entries_each, the last block may be full
+    int num_entries_each = SFS_BLOCK_SIZE / sizeof(struct sfs_entry);
+    uint32_t k = din->size / sizeof(struct sfs_entry);
+    uint32_t blockno;
+    uint8_t *buf;
+    if (k / num_entries_each >= din->blocks) {
+        blockno = allocate_block_from_idx(din, din->blocks);
+        if (blockno == 0) {
+            printf("sfs: no space left\n");
+            recycle_block(dir_inode);
+            return -1;
+        }
+        buf = buffer_new_block(blockno, 0);
     }
-    // 3. within indirect block
     else {
-        int num_entries = din->size / 32;  
-        int num_entries_each = SFS_BLOCK_SIZE / sizeof(struct sfs_entry);
-        // 3.1 new a new block
-        if ((num_entries + 1) % num_entries_each == 0) {
-            buf = read_block(din->indirect, 0);
-            uint32_t *indirect_block = (uint32_t *)buf;
-            uint32_t next_block = next_free_block();
-            indirect_block[din->blocks - SFS_NDIRECT] = next_block;
-            write_block(din->indirect, 0, buf);   
-
-            buf = read_block(next_block, 0);
-            struct sfs_entry *entry = (struct sfs_entry *)buf;
-            entry[0].ino = fino;
-            __strcpy(entry[0].filename, filename);
-            write_block(next_block, 0, buf);
-            din->blocks++;
-        }
-        // 3.2 within a block
+        blockno = block_from_idx(din, k / num_entries_each);
+        buf = blockno == 0 ? NULL : read_block(blockno, 0);
+    }
+    if (buf == NULL) {
+        recycle_block(dir_inode);
+        return -1;
+    }
+    struct sfs_entry *entry = (struct sfs_entry *)buf + k % num_entries_each;
+    entry->ino = fino;
+    __strcpy(entry->filename, filename);
+    write_block(blockno, 0, buf);
+    // keep the index in step with the entries, or drop it
+    if (sfs_extents()) {
+        if (din->dir_index != 0 && !dir_index_valid(din)) dir_index_drop(din);
+        if (din->dir_index != 0) {
+            if (dir_index_insert(din, name_hash(filename), k) != 0) dir_index_drop(din);
+            din->size += sizeof(struct sfs_entry);
+        }
         else {
-            buf = read_block(din->indirect, 0);
-            uint32_t *indirect_block = (uint32_t *)buf;
-            uint32_t next_block = indirect_block[din->blocks - SFS_NDIRECT - 1];
-            read_block(next_block, buf);
-            buf = read_block(next_block, 0);
-
-            struct sfs_entry *entry = (struct sfs_entry *)buf;
-            int idx = num_entries % num_entries_each;
-            entry[idx].ino = fino;
-            __strcpy(entry[idx].filename, filename);
-            write_block(next_block,0, buf); 
+            din->size += sizeof(struct sfs_entry);
+            if (k + 1 >= SFS_DIR_INDEX_MIN) dir_index_build(din);
         }
     }
-    din->size += 32;
-    write_block(dir_inode, 1, __dir);
+    else din->size += sizeof(struct sfs_entry);
+    write_block(dir_inode, 1, (uint8_t *)din);
+    // replaces the negative entry left by the check above
+    dcache_add(dir_inode, filename, fino);
+    recycle_block(dir_inode);
+    return 0;
 }
+// the new directory is entered last, on failure nothing points at it.
+// returns 0 on failure.
 uint32_t mkdir(uint32_t dir_inode,char * dir_name){
     uint32_t new_dir_ino = next_free_block();
-    register_entry(dir_inode, dir_name, new_dir_ino);
-    struct sfs_inode* new_dir_inode = (struct sfs_inode *)read_block(new_dir_ino, 1);
+    struct sfs_inode* new_dir_inode = (struct sfs_inode *)buffer_new_block(new_dir_ino, 1);
+    if (new_dir_inode == NULL) {
+        release_block(new_dir_ino);
+        return 0;
+    }
+    reclaim_block(new_dir_ino);
+    inode_init(new_dir_inode, SFS_DIRECTORY);
     new_dir_inode->size = 64;
-    new_dir_inode->type = SFS_DIRECTORY;
-    new_dir_inode->links = 1;
-    new_dir_inode->blocks = 1;
-    new_dir_inode->direct[0] = next_free_block();
-    new_dir_inode->indirect = 0;
-    uint8_t * buf = read_block(new_dir_inode->direct[0], 0);
-    reset_buffer(buf);
-    struct sfs_entry *entry = (struct sfs_entry *) buf;
-    entry[0].ino = new_dir_ino;
-    __strcpy(entry[0].filename, ".");
-    entry[1].ino = dir_inode;
-    __strcpy(entry[1].filename, "..");
-    write_block(new_dir_inode->direct[0], 0, buf);
-    write_block(new_dir_ino, 1, (uint8_t *)new_dir_inode);
+    uint32_t blockno = allocate_block_from_idx(new_dir_inode, 0);
+    uint8_t * buf = blockno == 0 ? NULL : buffer_new_block(blockno, 0);
+    if (buf != NULL) {
+        struct sfs_entry *entry = (struct sfs_entry *) buf;
+        entry[0].ino = new_dir_ino;
+        __strcpy(entry[0].filename, ".");
+        entry[1].ino = dir_inode;
+        __strcpy(entry[1].filename, "..");
+        write_block(blockno, 0, buf);
+        write_block(new_dir_ino, 1, (uint8_t *)new_dir_inode);
+    }
+    recycle_block(new_dir_ino);
+    if (buf == NULL || register_entry(dir_inode, dir_name, new_dir_ino) != 0) {
+        if (blockno != 0) {
+            buffer_drop(blockno);
+            release_block(blockno);
+        }
+        buffer_drop(new_dir_ino);
+        release_block(new_dir_ino);
+        return 0;
+    }
     return new_dir_ino;
 }
-void init_fd(int fd, uint32_t fino, uint32_t dir_inode, uint32_t flags){
+// returns 0 on success
+int init_fd(int fd, uint32_t fino, uint32_t dir_inode, uint32_t flags){
+    // inode and path stay pinned in the buffer until sfs_close
+    if (read_block(fino, 1) == NULL) return -1;
+    reclaim_block(fino);
+    if (read_block(dir_inode, 1) == NULL) {
+        recycle_block(fino);
+        return -1;
+    }
+    reclaim_block(dir_inode);
     if (current->fs.fds[fd] == NULL) {
         current->fs.fds[fd] = (struct file *)kmalloc(sizeof(struct file));
     }
     current->fs.fds[fd]->flags = flags;
     current->fs.fds[fd]->off = 0;
+    current->fs.fds[fd]->ra_start = 0;
+    current->fs.fds[fd]->ra_size = 0;
+    current->fs.fds[fd]->ra_async_size = 0;
+    current->fs.fds[fd]->ra_prev = 0;
     current->fs.fds[fd]->inode = (struct sfs_inode * )read_block(fino, 1);
     current->fs.fds[fd]->path = (struct sfs_inode *)read_block(dir_inode, 1);
     current->fs.fds[fd]->inode_blockno = fino;
     current->fs.fds[fd]->path_blockno = dir_inode;
-    reclaim_block(fino);
-    reclaim_block(dir_inode);
     // printf("fino = %d, dir_inode = %d\n", fino, dir_inode);
     // printf("inode = %x, path = %x\n", current->fs.fds[fd]->inode, current->fs.fds[fd]->path);
+    return 0;
 }
+// like mkdir, returns 0 on failure
 uint32_t touch(uint32_t dir_inode, char * filename){
     uint32_t fino = next_free_block();
-    register_entry(dir_inode, filename, fino);
-    struct sfs_inode* file_inode = (struct sfs_inode *)read_block(fino, 1);
-    file_inode->size = 0;
-    file_inode->type = SFS_FILE;
-    file_inode->links = 1;
-    file_inode->blocks = 0;
-    file_inode->indirect = 0;
+    struct sfs_inode* file_inode = (struct sfs_inode *)buffer_new_block(fino, 1);
+    if (file_inode == NULL) {
+        release_block(fino);
+        return 0;
+    }
+    inode_init(file_inode, SFS_FILE);
     write_block(fino, 1, (uint8_t *)file_inode);
-    return fino;
-}
-int recycle_block(uint32_t blockno){
-    // disclaime the block
-    mem_block_ptr ptr;
-    int in_buffer = get_block_from_buffer(blockno, &ptr);
-    uint32_t pid = current->pid;
-    if (in_buffer){
-        if (ptr->reclaim_count) 
-        {
-            int k;
-            for (k = 0; k < ptr->reclaim_count && ptr->reclaim_pid[k] != pid; k++);
-            if (k == ptr->reclaim_count) { printf("recycle failed. reclaim pid not found\n"); return 0; }
-            // left shift
-            for (int i = k; i < ptr->reclaim_count - 1; i++) ptr->reclaim_pid[i] = ptr->reclaim_pid[i + 1];
-            ptr->reclaim_count--;
-        }
-    }
-    return in_buffer;
-}
-int reclaim_block(uint32_t blockno){
-    mem_block_ptr ptr;
-    if (get_block_from_buffer(blockno, &ptr)) {
-        if (ptr->reclaim_count == SFS_RECLAIM_THRESHOLD) {
-            printf("reclaim failed. reclaim count exceed threshold\n");
-            return -1;
-        }
-        // check if already in reclaim list
-        int i;
-        for (i = 0; i < ptr->reclaim_count && ptr->reclaim_pid[i] != current->pid; i++);
-        if (i == ptr->reclaim_count)  ptr->reclaim_pid[ptr->reclaim_count++] = current->pid;
-        return 1;
+    if (register_entry(dir_inode, filename, fino) != 0) {
+        buffer_drop(fino);
+        release_block(fino);
+        return 0;
     }
-    return 0;
+    return fino;
 }
-
 // --------------------------------------------
 // -------------- SFS functions ---------------
 // --------------------------------------------
@@ -483,14 +945,26 @@ int sfs_init(){
     }
     __sfs->super_dirty = 0;
     // init buffer
-    __sfs->buffer = (buffer_t) kmalloc(sizeof(mem_block_ptr) * SFS_BUFFER_SIZE);
-    for (int i = 1; i < SFS_BUFFER_SIZE; i++) __sfs->buffer[i] = NULL;  
+    buffer_init(SFS_BUFFER_SIZE);
+    dcache_init(SFS_DCACHE_SIZE);
     // init freemap
-    int bytes = __sfs->super.blocks / 8;
-    int num_blocks = bytes / SFS_BLOCK_SIZE;
-    if (num_blocks % SFS_BLOCK_SIZE != 0 || num_blocks == 0) num_blocks++;
+    int num_blocks = (__sfs->super.blocks + SFS_BLOCK_SIZE * 8 - 1) / (SFS_BLOCK_SIZE * 8);
     __sfs->freemap = (bitmap *)kmalloc(sizeof(bitmap) * num_blocks * SFS_BLOCK_SIZE);
     for (int i = 0; i < num_blocks; i++) { disk_read(2 + i, (uint8_t *)__sfs->freemap + i * SFS_BLOCK_SIZE); }
+    __sfs->freemap_blocks = num_blocks;
+    __sfs->freemap_dirty = (uint8_t *)kmalloc(num_blocks);
+    memset(__sfs->freemap_dirty, 0, num_blocks);
+    // free counts per group, bits past the last block count as used
+    __sfs->ngroups = (__sfs->super.blocks + SFS_GROUP_BLOCKS - 1) / SFS_GROUP_BLOCKS;
+    __sfs->group_free = (uint32_t *)kmalloc(sizeof(uint32_t) * __sfs->ngroups);
+    for (int g = 0; g < __sfs->ngroups; g++) {
+        uint32_t end = min((g + 1) * SFS_GROUP_BLOCKS, __sfs->super.blocks);
+        __sfs->group_free[g] = 0;
+        for (uint32_t i = g * SFS_GROUP_BLOCKS; i < end; i++) {
+            if (!(__sfs->freemap[i / 8] & (1 << (i % 8)))) __sfs->group_free[g]++;
+        }
+    }
+    __sfs->alloc_hint = 0;
     // init meta
     __sfs->meta.data_block_start = 2 + __sfs->super.blocks;
     __sfs->meta.init = 1;
@@ -512,7 +986,7 @@ int sfs_open(const char *path, uint32_t flags) {
             *kptr = 0;
             if (next_inode == 0) next_inode = 1; 
             else {
-                next_inode = find_in_dir(prev_inode, kname);
+                next_inode = lookup(prev_inode, kname);
                 if (next_inode == 0) {
                     if (flags & SFS_FLAG_WRITE) next_inode = mkdir(prev_inode, kname);
                     else {
@@ -520,6 +994,10 @@ int sfs_open(const char *path, uint32_t flags) {
                         return -1;
                     }
                 }
+                if (next_inode == 0 || next_inode == SFS_NO_BUFFER) {
+                    kfree(kname);
+                    return -1;
+                }
             }
             prev_inode = next_inode;
             kptr = kname;
@@ -533,13 +1011,17 @@ int sfs_open(const char *path, uint32_t flags) {
     *kptr = 0;
     if (__strlen(kname) == 0) {printf("Invalid path\n"); return -1;}
     uint32_t fino;
-    fino = find_in_dir(next_inode,kname);
+    fino = lookup(next_inode,kname);
     // check is file
     uint8_t * buf;
     if (!fino && (flags & SFS_FLAG_WRITE)) fino = touch(next_inode, kname);
     else if (fino){
-        buf = read_block(fino, 1);
+        buf = fino == SFS_NO_BUFFER ? NULL : read_block(fino, 1);
         struct sfs_inode * inode = (struct sfs_inode *)buf;
+        if (inode == NULL) {
+            kfree(kname);
+            return -1;
+        }
         if (inode->type == SFS_DIRECTORY) {
             kfree(kname);
             printf("%s Is a Directory\n", path);
@@ -552,28 +1034,23 @@ int sfs_open(const char *path, uint32_t flags) {
         return -1;
     }
 
+    kfree(kname);
+    if (fino == 0) return -1;
     int fd = next_file_descriptor();
     if (fd == -1) {printf("too many files opened\n"); return -1;}
-    init_fd(fd, fino, next_inode, flags);
-    kfree(kname);
+    if (init_fd(fd, fino, next_inode, flags) != 0) return -1;
     return fd;
 }
 
 int sfs_close(int fd){
     sfs_init();
     if (current->fs.fds[fd] == NULL) return -1;
-    // recycle all data blocks 
-    struct sfs_inode * inode = current->fs.fds[fd]->inode;
-    for (int i = 0; i < inode->blocks; i++) {
-        recycle_block(block_from_idx(inode, i));
-    }
-    
-    // free inode and path    
+    // write back modified blocks
+    buffer_sync();
+    // unpin inode and path, the memory is owned by the buffer
     recycle_block(current->fs.fds[fd]->inode_blockno);
     recycle_block(current->fs.fds[fd]->path_blockno);
-    kfree(current->fs.fds[fd]->inode);
     current->fs.fds[fd]->inode = NULL;
-    kfree(current->fs.fds[fd]->path);
     current->fs.fds[fd]->path = NULL;
     kfree(current->fs.fds[fd]);
     current->fs.fds[fd] = NULL;
@@ -607,9 +1084,18 @@ int sfs_read(int fd, char *buf, uint32_t len){
     uint8_t *block_buf = NULL;
     uint32_t cur_block = start_block;
     uint32_t cur_len = 0;
+    if ((current->fs.fds[fd]->flags & SFS_FLAG_DIRECT) && start_off == 0) {
+        uint32_t n = file_direct_io(current->fs.fds[fd], buf, start_block, bytes_to_read / SFS_BLOCK_SIZE, 0);
+        cur_block += n;
+        cur_len += n * SFS_BLOCK_SIZE;
+        current->fs.fds[fd]->ra_prev = cur_block;
+    }
     while (cur_block <= end_block) {
+        file_readahead(current->fs.fds[fd], cur_block, end_block);
+        current->fs.fds[fd]->ra_prev = cur_block + 1;
         uint32_t blockno = block_from_idx(current->fs.fds[fd]->inode, cur_block);
-        block_buf = read_block(blockno, 0);
+        block_buf = blockno == 0 ? NULL : read_block(blockno, 0);
+        if (block_buf == NULL) break;
         reclaim_block(blockno);
         if (cur_block == start_block && cur_block == end_block) {
             memcpy(buf, block_buf + start_off, bytes_to_read);
@@ -646,12 +1132,31 @@ int sfs_write(int fd, char *buf, uint32_t len){
     uint8_t *block_buf = NULL;
     uint32_t cur_block = start_block;
     uint32_t cur_len = 0;
-    current->fs.fds[fd]->inode->size = max(current->fs.fds[fd]->inode->size, end_offset + 1);
+    uint32_t prefetched = start_block; // first block not prefetched yet
+    uint32_t old_size = current->fs.fds[fd]->inode->size;
+    current->fs.fds[fd]->inode->size = max(old_size, end_offset + 1);
+    if ((current->fs.fds[fd]->flags & SFS_FLAG_DIRECT) && start_off == 0) {
+        uint32_t n = file_direct_io(current->fs.fds[fd], buf, start_block, len / SFS_BLOCK_SIZE, 1);
+        cur_block += n;
+        cur_len += n * SFS_BLOCK_SIZE;
+    }
     while (cur_block <= end_block) {
         uint32_t blockno;
+        // old content of blocks already in the file is read in merged requests
+        if (cur_block >= prefetched && cur_block < current->fs.fds[fd]->inode->blocks) {
+            prefetched = cur_block + SFS_MAX_RUN;
+            prefetch_file_blocks(current->fs.fds[fd]->inode, cur_block, min(end_block, prefetched - 1));
+        }
         if (cur_block < current->fs.fds[fd]->inode->blocks) { blockno = block_from_idx(current->fs.fds[fd]->inode, cur_block);}
-        else { blockno = allocate_block_from_idx(current->fs.fds[fd]->inode, cur_block); }
-        block_buf = read_block(blockno, 0);
+        else {
+            blockno = delalloc_block_from_idx(current->fs.fds[fd]->inode_blockno, current->fs.fds[fd]->inode, cur_block);
+            if (blockno == 0) {
+                printf("sfs: no space left\n");
+                break;
+            }
+        }
+        block_buf = blockno == 0 ? NULL : read_block(blockno, 0);
+        if (block_buf == NULL) break;
         reclaim_block(blockno);
         if (cur_block == start_block && cur_block == end_block) {
             memcpy(block_buf + start_off, buf, len);
@@ -668,12 +1173,18 @@ int sfs_write(int fd, char *buf, uint32_t len){
             write_block(blockno, 0, block_buf);
             cur_len += end_off + 1;
         }
+        else {
+            memcpy(block_buf, buf + cur_len, SFS_BLOCK_SIZE);
+            write_block(blockno, 0, block_buf);
+            cur_len += SFS_BLOCK_SIZE;
+        }
         recycle_block(blockno);
         cur_block++;
     }
     current->fs.fds[fd]->off += cur_len;
     write_block(current->fs.fds[fd]->inode_blockno, 1, (uint8_t *)current->fs.fds[fd]->inode);
     if (cur_len != len) {
+        current->fs.fds[fd]->inode->size = max(old_size, cur_off + cur_len);
         printf("write error\n");
     }
     return cur_len;
@@ -694,8 +1205,8 @@ int sfs_get_files(const char* path, char* files[]){
             *kptr = 0;
             if (__inode == 0) __inode = 1; 
             else {
-                __inode = find_in_dir(__inode, kname);
-                if (__inode == 0) {
+                __inode = lookup(__inode, kname);
+                if (__inode == 0 || __inode == SFS_NO_BUFFER) {
                     printf("No such file or dir\n");
                     return -1;
                 }
@@ -710,18 +1221,21 @@ int sfs_get_files(const char* path, char* files[]){
     }
     *kptr = 0;
     if (__strlen(kname) != 0) {
-        __inode = find_in_dir(__inode, kname);
-        if (__inode == 0) {
+        __inode = lookup(__inode, kname);
+        if (__inode == 0 || __inode == SFS_NO_BUFFER) {
             printf("No such file or dir\n");
             return -1;
         }
     }
     // get dir inode
     uint8_t *__dir = read_block(__inode, 1);
+    if (__dir == NULL) return -1;
     struct sfs_inode * din = (struct sfs_inode *)__dir;
     if (din->type != SFS_DIRECTORY) {
         return 0;
     }
+    // faulting in the user's buffers below may read other blocks
+    reclaim_block(__inode);
     // search in dir
     uint8_t *buf;
     uint32_t num_entries = din->size / 32;
@@ -729,14 +1243,22 @@ int sfs_get_files(const char* path, char* files[]){
     int num_entries_each = SFS_BLOCK_SIZE / sizeof(struct sfs_entry);
     for (int i = 0; i < din->blocks; i++) {
         uint32_t block_number = block_from_idx(din, i);
-        buf = read_block(block_number, 0);
+        buf = block_number == 0 ? NULL : read_block(block_number, 0);
+        if (buf == NULL) break;
+        reclaim_block(block_number);
         struct sfs_entry *entry = (struct sfs_entry *)buf;
         if (i == din->blocks - 1) num_entries_each = num_entries - i * num_entries_each;
         for (int j = 0; j < num_entries_each; j++) {
+            // files[] and the name buffers are user memory, maybe not
+            // mapped yet or shared copy-on-write
+            vma_prefault((uint64_t)&files[cnt], sizeof(char *), 0);
+            vma_prefault((uint64_t)files[cnt], SFS_MAX_FILENAME_LEN + 1, 1);
             __strcpy(files[cnt], entry[j].filename);
             cnt++;
         }
+        recycle_block(block_number);
     }
+    recycle_block(__inode);
     kfree(kname);
     return cnt;
 }
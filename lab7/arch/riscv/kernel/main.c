@@ -3,12 +3,22 @@
 #include "sched.h"
 #include "mm.h"
 #include "virtio.h"
+#include "vm.h"
+#include "riscv.h"
 
 int start_kernel() {
+#ifdef __riscv_vector
+  // memcpy/memset use vector instructions, turn the vector unit on
+  set_csr(sstatus, SSTATUS_VS_INITIAL);
+#endif
   puts("ZJU OSLAB 7 学号:3220102854 姓名:吴晨宇\n");
   puts("ZJU OSLAB 7 学号:3220106025 姓名:李宇怀\n");
   
   slub_init();
+#ifdef MEM_BENCH
+  mem_bench();
+#endif
+  asid_init();
   task_init();
   plic_init();
   
@@ -3,42 +3,95 @@
 #include "vm.h"
 #include "stdio.h"
 
-#define set_split(x) ((unsigned int)(x) | 0x80000000)
-#define set_unsplit(x) ((unsigned int)(x) & 0x7fffffff)
-#define get_size(x) set_unsplit(x)
-#define check_split(x) ((unsigned int)(x) & 0x80000000)
-
-uint64_t get_index(uint64_t va) {
-  uint64_t offset = (va - buddy_system.base_addr) / PAGE_SIZE;
-  int block_size = 1;
-  while(offset % block_size == 0) {
-    block_size <<= 1;
-  }
-  block_size = block_size >> 1;
-  return ((MEMORY_SIZE / PAGE_SIZE) / block_size) + (offset / block_size);
+// ---------------------------------------------------------------------
+// 伙伴系统：frames 数组为每个物理页记录一个描述符。空闲块的首页记录块的阶并
+// 挂在该阶的空闲链表上 (链表用页号相连)，分配出去的首页记录分配的页数，
+// 所以释放时不需要再搜索。分配 num 页时先取一个 2^order >= num 的块，再把
+// 多出来的尾部按对齐的块还回去，num 不必是 2 的幂。
+//
+// 另有一个预先清零的单页池 (zero pool)：空闲时 (schedule 找不到可运行的进程，
+// 比如等待磁盘时) 从伙伴系统取页清零后放进池中，需要清零的单页分配直接从池
+// 中取。池中的页对外算作空闲，由 shrinker 在内存不足时还给伙伴系统。
+//
+// 伙伴系统分配失败时按 seeks 从小到大调用注册的 shrinker，每个回收了东西就
+// 重试一次；一轮下来有回收就再来一轮 (对象缓存释放的对象让 slab 变空，下一
+// 轮才能把页还回来)，直到分配成功或者没有东西可回收。
+
+#define NR_FRAMES (MEMORY_SIZE / PAGE_SIZE)
+#define MAX_ORDER 12 // 2^12 页即 MEMORY_SIZE
+
+struct frame {
+  int16_t order; // 空闲块首页为块的阶，其它页为 -1
+  uint16_t nr;   // 分配的首页为分配的页数，其它页为 0
+  int16_t next;  // 同阶空闲链表，-1 表示结尾
+  int16_t prev;
+};
+
+// 伙伴系统管理 [buddy_base, buddy_base + MEMORY_SIZE) 的物理页
+static uint64_t buddy_base;
+static bool buddy_initialized;
+static struct frame frames[NR_FRAMES];
+static int16_t free_area[MAX_ORDER + 1];
+static uint64_t nr_free;
+
+// 预先清零的页，用 frames[].next 串成栈，池中的页在伙伴系统看来是已分配的
+#define ZERO_POOL_SIZE 32
+// 伙伴系统的空闲页不多于这个数时不再补充，留给真正的分配
+#define ZERO_POOL_RESERVE 64
+static int16_t zero_pool = -1;
+static int zero_pool_nr;
+static uint64_t zero_pool_hits, zero_pool_misses;
+
+static LIST_HEAD(shrinkers);
+// shrinkers free memory, they must not end up here again
+static bool shrinking;
+
+static void free_list_add(int idx, int order) {
+  frames[idx].order = order;
+  frames[idx].prev = -1;
+  frames[idx].next = free_area[order];
+  if (free_area[order] >= 0) frames[free_area[order]].prev = idx;
+  free_area[order] = idx;
 }
 
-uint64_t get_addr(int index) {
-  int level = 0, index_copy = index;
-  while(index_copy > 1) {
-    index_copy >>= 1;
-    level++;
-  }
+static void free_list_del(int idx, int order) {
+  if (frames[idx].prev >= 0) frames[frames[idx].prev].next = frames[idx].next;
+  else free_area[order] = frames[idx].next;
+  if (frames[idx].next >= 0) frames[frames[idx].next].prev = frames[idx].prev;
+  frames[idx].order = -1;
+}
 
-  int block_size = MEMORY_SIZE >> level;
-  int offset = (index - (1 << level)) * block_size;
-  return buddy_system.base_addr + offset;
+// free the block of 2^order pages at idx, merging it with free buddies
+static void free_block(int idx, int order) {
+  nr_free += 1 << order;
+  while (order < MAX_ORDER) {
+    int buddy = idx ^ (1 << order);
+    if (frames[buddy].order != order) break;
+    free_list_del(buddy, order);
+    idx &= ~(1 << order);
+    order++;
+  }
+  free_list_add(idx, order);
 }
 
-uint32_t get_block_size(int index) {
-  int level = 0, index_copy = index;
-  while(index_copy > 1) {
-    index_copy >>= 1;
-    level++;
+// free n pages at idx as the largest aligned blocks that fit
+static void free_range(int idx, int n) {
+  while (n > 0) {
+    int order = 0;
+    while (order < MAX_ORDER && idx % (2 << order) == 0 && (2 << order) <= n) order++;
+    free_block(idx, order);
+    idx += 1 << order;
+    n -= 1 << order;
   }
-  return MEMORY_SIZE >> level;
 }
 
+static uint64_t frame_addr(int idx) {
+  return buddy_base + (uint64_t)idx * PAGE_SIZE;
+}
+
+static int frame_index(uint64_t pa) {
+  return (PHYSICAL_ADDR(pa) - buddy_base) / PAGE_SIZE;
+}
 
 uint64_t alloc_page() {
   return alloc_pages(1);
@@ -46,180 +99,157 @@ uint64_t alloc_page() {
 
 int alloced_page_num() {
   // 返回已经分配的物理页面的数量
-  // 在buddy system中，我们不再使用该函数
-  return -1;
+  return NR_FRAMES - nr_free - zero_pool_nr;
 }
 
 void init_buddy_system() {
-  // TODO: 初始化buddy system
-  // 1. 将buddy system的每个节点初始化为可分配的内存大小，单位为PAGE_SIZE
-  // 注意我们用buddy_system.bitmap实现一个满二叉树，其下标变化规律如下：如果当前节点的下标是 X，那么左儿子就是 `X * 2` ，右儿子就是 `X * 2 + 1` ，X 从1开始。
-  // 那么，下标为 X 的节点可分配的内存为多少呢？
-  // 2. 将buddy system的base_addr设置为&_end的物理地址
-  // 3. 将buddy system的initialized设置为true
-
-  buddy_system.bitmap[1] = MEMORY_SIZE / PAGE_SIZE;
-  for(int i = 2; i < 8192; ++i) {
-    if(buddy_system.bitmap[i] == 0) {
-      buddy_system.bitmap[i] = buddy_system.bitmap[i/2] / 2;
-    }
+  // 所有页组成一个 MAX_ORDER 阶的空闲块，base 为 &_end 的物理地址
+  for (int i = 0; i < NR_FRAMES; i++) {
+    frames[i].order = -1;
+    frames[i].nr = 0;
   }
-  buddy_system.base_addr = PHYSICAL_ADDR((uint64_t)&_end);
-  buddy_system.initialized = 1;
-};
+  for (int i = 0; i <= MAX_ORDER; i++) free_area[i] = -1;
+  nr_free = 0;
+  free_block(0, MAX_ORDER);
+  buddy_base = PHYSICAL_ADDR((uint64_t)&_end);
+  buddy_initialized = 1;
+}
 
-uint64_t alloc_buddy(int index, unsigned int num) {
-  // TODO: 找到可分配的节点并完成分配，返回分配的物理页面的首地址（通过get_addr函数可以获取节点index的起始地址）
-  // 1. 如果当前节点的可连续分配内存大于num，则查看当前节点的左右儿子节点
-  // 提示：通过get_size函数可以获取节点index的可连续分配内存大小
-  // 2. 如果当前节点的可连续分配内存等于num，且当前节点没有被拆分，则分配当前节点
-  // 提示：通过check_split函数可以获取节点index的状态
-  // 3. 如果当前节点的可连续分配内存等于num且已经被拆分，则查看当前节点的左右儿子节点
-  // 4. 如果当前节点的可连续分配内存小于num，则分配失败返回上层节点
-  // 如果完成分配，则要递归更新节点信息，将涉及到的节点的可连续分配内存减去num，并使用set_split更新节点的状态
-  if (get_size(buddy_system.bitmap[index]) > num) {
-    uint64_t addr = alloc_buddy(index * 2, num);
-    if(addr == 0) {
-      addr = alloc_buddy(index * 2 + 1, num);
-    }
-    if (addr != 0) {
-      buddy_system.bitmap[index] = set_split(
-        get_size(buddy_system.bitmap[index*2]) > get_size(buddy_system.bitmap[index*2+1]) ? 
-        get_size(buddy_system.bitmap[index*2]) : get_size(buddy_system.bitmap[index*2+1]));
-    }
-    return addr;
-  }
-  else if (get_size(buddy_system.bitmap[index]) == num) {
-    if (!check_split(buddy_system.bitmap[index])) {
-      buddy_system.bitmap[index] = 0;
-      return get_addr(index);
-    }
-    else {
-      uint64_t addr = alloc_buddy(index * 2, num);
-      if(addr == 0) {
-        addr = alloc_buddy(index * 2 + 1, num);
-      }
-      if (addr != 0) {
-        buddy_system.bitmap[index] = buddy_system.bitmap[index]-num;
-      }
-      return addr;
-    }
-  }
-  else {
-    return 0;
+// take num pages from the buddy lists, their content is left as it was
+static uint64_t buddy_alloc(unsigned int num) {
+  int order = 0;
+  while ((1U << order) < num) order++;
+  int o = order;
+  while (o <= MAX_ORDER && free_area[o] < 0) o++;
+  if (o > MAX_ORDER) return 0;
+
+  // 取最小的够用的块，拆开时低地址的一半留下，高地址的一半放回空闲链表
+  int idx = free_area[o];
+  free_list_del(idx, o);
+  nr_free -= 1 << o;
+  while (o > order) {
+    o--;
+    free_block(idx + (1 << o), o);
   }
+  if (num < (1U << order)) free_range(idx + num, (1 << order) - num);
+  frames[idx].nr = num;
+  return frame_addr(idx);
 }
 
-uint64_t alloc_pages(unsigned int num) {
-  // 分配num个页面，返回分配到的页面的首地址，如果没有足够的空闲页面，返回0
-  if (!buddy_system.initialized) {
-    init_buddy_system();
-  }
+static uint64_t zero_pool_pop() {
+  int idx = zero_pool;
+  zero_pool = frames[idx].next;
+  frames[idx].next = -1;
+  zero_pool_nr--;
+  return frame_addr(idx);
+}
 
-  uint64_t addr = 0;
+// give every pooled page back to the buddy system
+static uint64_t zero_pool_shrink(uint64_t nr) {
+  uint64_t freed = 0;
+  for (; zero_pool >= 0 && freed < nr; freed++) free_pages(zero_pool_pop());
+  return freed;
+}
 
-  // TODO:
-  // 1. 将num向上对齐到2的幂次
-  // 2. 调用alloc_buddy函数完成分配
+static struct shrinker zero_pool_shrinker = {
+    .name = "zero pool", .seeks = 0, .scan = zero_pool_shrink};
+
+// zero up to max pages into the pool while memory is plentiful.
+// returns the number of pages zeroed.
+int zero_pool_refill(int max) {
+  int n = 0;
+  if (!buddy_initialized) return 0;
+  while (n < max && zero_pool_nr < ZERO_POOL_SIZE && nr_free > ZERO_POOL_RESERVE) {
+    uint64_t addr = buddy_alloc(1);
+    memset((void *)addr, 0, PAGE_SIZE);
+    int idx = frame_index(addr);
+    frames[idx].next = zero_pool;
+    zero_pool = idx;
+    zero_pool_nr++;
+    n++;
+  }
+  return n;
+}
 
-  int i = 1;
-  while (i < num) {
-    i *= 2;
+void zero_pool_stat() {
+  printf("[zero pool] pages %d/%d hits %d misses %d\n", zero_pool_nr, ZERO_POOL_SIZE,
+         (int)zero_pool_hits, (int)zero_pool_misses);
+}
+
+void register_shrinker(struct shrinker *s) {
+  struct shrinker *pos;
+  list_for_each_entry(pos, &shrinkers, list) {
+    if (pos->seeks > s->seeks) break;
   }
-  addr = alloc_buddy(1, i);
+  s->nr_calls = 0;
+  s->nr_freed = 0;
+  list_add_tail(&s->list, &pos->list);
+}
 
-  // set the allocated pages to 0
-  if (addr != 0) {
-    for(int i = 0; i < num * PAGE_SIZE; ++i) {
-      *(char *)(addr + i) = 0;
-    }
+void shrinker_stat() {
+  struct shrinker *s;
+  list_for_each_entry(s, &shrinkers, list) {
+    printf("[shrinker] %s calls %d freed %d pages\n", s->name, (int)s->nr_calls,
+           (int)s->nr_freed);
   }
+}
 
+// reclaim through the shrinkers until num pages can be allocated
+static uint64_t shrink_alloc(unsigned int num) {
+  struct shrinker *s;
+  uint64_t addr = 0, freed;
+  if (shrinking) return 0;
+  shrinking = 1;
+  do {
+    freed = 0;
+    list_for_each_entry(s, &shrinkers, list) {
+      uint64_t n = s->scan(num);
+      s->nr_calls++;
+      s->nr_freed += n;
+      freed += n;
+      if (n > 0 && (addr = buddy_alloc(num)) != 0) break;
+    }
+  } while (addr == 0 && freed > 0);
+  shrinking = 0;
   return addr;
 }
 
-
-// void free_buddy(int index) {
-//   // TODO: 释放节点index的页面
-//   // 1. 首先判断节点index的状态，如果已经被拆分，则不能直接释放。异常状态，报错并进入死循环。
-//   // 2. 如果没有被拆分，则恢复节点index的状态为初始状态
-//   // 3. 如果该节点与其兄弟节点都没有被使用，则合并这两个节点，并迭代处理父节点
-//   // 提示：使用check_split函数可以获取节点index的状态
-//   // 提示：使用set_unsplit函数可以将节点index的状态恢复为初始状态
-//   // 提示：使用get_block_size函数可以获取节点index的初始可连续分配内存大小
-
-//   if (check_split(buddy_system.bitmap[index])) {
-//     printf("error: free page failed\n");
-//     while(1);
-//     return;
-//   }
-//   else {
-//     buddy_system.bitmap[index] = get_block_size(index);
-//     while (index != 1) {
-//       if (buddy_system.bitmap[index] == buddy_system.bitmap[index ^ 1]) {
-//         buddy_system.bitmap[index / 2] = buddy_system.bitmap[index] + buddy_system.bitmap[index ^ 1];
-//         index /= 2;
-//       }
-//       else {
-//         break;
-//       }
-//     }
-//   }
-// }
-void free_buddy(int index) {
-  // DONE: 释放节点index的页面
-  // 1. 首先判断节点index的状态，如果已经被拆分，则不能直接释放。异常状态，报错并进入死循环。
-  // 2. 如果没有被拆分，则恢复节点index的状态为初始状态
-  // 3. 如果该节点与其兄弟节点都没有被使用，则合并这两个节点，并迭代处理父节点
-  // 提示：使用check_split函数可以获取节点index的状态
-  // 提示：使用set_unsplit函数可以将节点index的状态恢复为初始状态
-  // 提示：使用get_block_size函数可以获取节点index的初始可连续分配内存大小
-
-  if (check_split(buddy_system.bitmap[index])) {
-    printf("error: free page failed\n");
-    while(1);
-    return;
+uint64_t alloc_pages_flags(unsigned int num, int flags) {
+  // 分配num个页面，返回分配到的页面的首地址，如果没有足够的空闲页面，返回0
+  if (!buddy_initialized) {
+    init_buddy_system();
+    register_shrinker(&zero_pool_shrinker);
   }
-  else {
-    buddy_system.bitmap[index] = get_block_size(index);
-    while (index != 1) {
-      if (buddy_system.bitmap[index] == buddy_system.bitmap[index ^ 1] && !check_split(buddy_system.bitmap[index])) {
-        buddy_system.bitmap[index / 2] = buddy_system.bitmap[index] + buddy_system.bitmap[index ^ 1];
-        index /= 2;
-      }
-      else {
-        unsigned int old_size = buddy_system.bitmap[index / 2];
-        buddy_system.bitmap[index / 2] = set_split(get_size(buddy_system.bitmap[index]) > get_size(buddy_system.bitmap[index ^ 1]) ?
-        get_size(buddy_system.bitmap[index]) : get_size(buddy_system.bitmap[index ^ 1]));
-        if (old_size == buddy_system.bitmap[index / 2]) {
-          break;
-        }
-        index /= 2;
-      }
+  if (num == 0 || num > NR_FRAMES) return 0;
+
+  if (num == 1 && !(flags & ALLOC_NOZERO)) {
+    if (zero_pool >= 0) {
+      zero_pool_hits++;
+      return zero_pool_pop();
     }
+    zero_pool_misses++;
   }
+  uint64_t addr = buddy_alloc(num);
+  if (addr == 0) addr = shrink_alloc(num);
+  if (addr == 0) return 0;
+  if (!(flags & ALLOC_NOZERO)) memset((void *)addr, 0, num * PAGE_SIZE);
+  return addr;
 }
 
-void free_pages(uint64_t pa) {
-  // TODO: find the buddy system node according to pa, and free it.
-  // 注意，如果该节点的状态为已经被拆分，则应该释放其左子节点
-  // 提示：使用get_index函数可以获取pa对应的最上层节点的下标
+uint64_t alloc_pages(unsigned int num) {
+  return alloc_pages_flags(num, 0);
+}
 
-  int index = get_index(pa);
-  while(check_split(buddy_system.bitmap[index])) {
-    index *= 2;
+void free_pages(uint64_t pa) {
+  // 按首页记录的页数释放整个分配
+  int idx = frame_index(pa);
+  if (idx < 0 || idx >= NR_FRAMES || frames[idx].nr == 0) {
+    printf("error: free page failed\n");
+    while(1);
+    return;
   }
-  free_buddy(index);
-
-
-  return;
-
+  int n = frames[idx].nr;
+  frames[idx].nr = 0;
+  free_range(idx, n);
 }
 
-void memcpy(void * dst, void * src, size_t size) {
-  char * a = dst;
-  char * b = src;
-  while (size--) {
-    *a++ = *b++;
-  }
-}
\ No newline at end of file
@@ -1,12 +1,16 @@
 #include "sched.h"
 #include "defs.h"
+#include "fs.h"
 #include "mm.h"
 #include "task_manager.h"
+#include "vm.h"
 
 // If next==current,do nothing; else update current and call __switch_to.
 void switch_to(struct task_struct *next) {
   if (current != next) {
     struct task_struct *prev = current;
+    // next may need a fresh ASID, its TLB entries stay valid otherwise
+    asid_switch(next);
     current = next;
     __switch_to(prev, next);
   }
@@ -20,7 +24,21 @@ void call_first_process() {
   schedule(0);
 }
 
+// set by virtio_disk_intr() after waking a task blocked on disk I/O
+int need_resched = 0;
+
+uint64_t jiffies = 0;
+
 void do_timer(void) {
+  jiffies++;
+  // write back aged dirty blocks of the file system
+  sfs_flusher_tick();
+
+  // give a task woken by a disk completion a chance to preempt current
+  if (need_resched) {
+    need_resched = 0;
+    schedule(1);
+  }
 }
 
 // Select the next task to run. If all tasks are done(counter=0), set task0's
@@ -38,6 +56,10 @@ void schedule(bool self) {
     if (!self && task[i] == current) {
       continue;
     }
+    // sleeping on disk I/O
+    if (task[i]->blocked) {
+      continue;
+    }
     if (task[i]->priority < min_p && task[i]->counter > 0) {
       min_p = task[i]->priority;
       min = task[i]->counter;
@@ -49,7 +71,9 @@ void schedule(bool self) {
     }
   }
 
+  // nothing runnable: zero a page for the zero pool while we wait
   if (next == NR_TASKS) {
+    zero_pool_refill(1);
     return;
   }
 
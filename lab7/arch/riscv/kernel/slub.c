@@ -2,6 +2,7 @@
 
 #include "mm.h"
 #include "stddef.h"
+#include "stdio.h"
 
 enum { PAGE_FREE, PAGE_BUDDY, PAGE_SLUB, PAGE_RESERVE };
 
@@ -9,19 +10,27 @@ struct cache_area cache_region;
 unsigned long cache_tid = 0;
 
 struct kmem_cache *slub_allocator[NR_PARTIAL] = {};
+// every cache, for the shrinker
+static LIST_HEAD(slab_caches);
 void *page_base;
 
-const size_t kmem_cache_objsize[] = {8, 16, 32, 64, 128, 256, 512, 1024, 2048};
+const size_t kmem_cache_objsize[] = {8,    16,   32,   64,   128,  256,  512,
+                                     1024, 2048, 3072, 4096, 8192, 16384};
 const char *kmem_cache_name[] = {
-    "slub-objectsize-8   ", "slub-objectsize-16  ", "slub-objectsize-32  ",
-    "slub-objectsize-64  ", "slub-objectsize-128 ", "slub-objectsize-256 ",
-    "slub-objectsize-512 ", "slub-objectsize-1024", "slub-objectsize-2048"};
+    "slub-objectsize-8    ", "slub-objectsize-16   ", "slub-objectsize-32   ",
+    "slub-objectsize-64   ", "slub-objectsize-128  ", "slub-objectsize-256  ",
+    "slub-objectsize-512  ", "slub-objectsize-1024 ", "slub-objectsize-2048 ",
+    "slub-objectsize-3072 ", "slub-objectsize-4096 ", "slub-objectsize-8192 ",
+    "slub-objectsize-16384"};
+
+// bytes asked for through kmalloc in each class, the last entry counts the
+// allocations handed to the buddy system (in pages)
+static unsigned long kmalloc_requested[NR_PARTIAL + 1];
+static unsigned long kmalloc_large_allocs, kmalloc_large_pages;
 
 #define IS_POWER_OF_2(x) (((x) & ((x)-1)))
 #define ALIGN_SIZE(size, aligns) (((size - 1) / aligns + 1) * aligns)
 #define STRUCT_PAGE_SIZE (ALIGN_SIZE(sizeof(struct page), 8))
-#define GET_NR_PAGE_PER_SLUB(size) \
-  (size < PAGE_SIZE ? 4 : ((size / PAGE_SIZE) + 1) * 4)
 #define ADDR_TO_PAGE(addr)                                            \
   ((struct page *)(page_base +                                        \
                    (((PHYSICAL_ADDR((unsigned long)addr) - PHYSICAL_ADDR((uint64_t)&_end)) & PAGE_MASK) >> \
@@ -31,14 +40,6 @@ const char *kmem_cache_name[] = {
   ((uint64_t)((((page_addr - page_base) / STRUCT_PAGE_SIZE) << PAGE_SHIFT) + \
             PHYSICAL_ADDR((uint64_t)&_end)))
 
-void *memset(void *dst, int c, uint32_t n) {
-  char *cdst = (char *)dst;
-  for (int i = 0; i < n; i++) {
-    cdst[i] = c;
-  }
-  return dst;
-}
-
 void set_page_attr(void *addr, int nr, int attr) {
   struct page *page, *npage;
   if (addr == NULL) return;
@@ -145,6 +146,40 @@ struct kmem_cache *alloc_slub_structure() {
   return p;
 }
 
+// --------------------------------------------------
+// ------------------ Slab Caches -------------------
+// --------------------------------------------------
+// 每个 cache 有一个活动的 slab (cache->page)，它的空闲对象全部挂在
+// cache->freelist 上，分配和释放到活动 slab 的对象只操作这条链表和 tid，
+// 不碰 struct page。其它 slab 的空闲对象挂在首页的 page->freelist 上，
+// 首页的 count 为已分配的对象数 (活动 slab 的对象都算作已分配)。
+// 不活动的 slab 按是否还有空闲对象放在 partial 或 full 链表上，
+// cache->freelist 用完时从 partial 表头取一个 slab，没有才分配新的。
+// 只有一个 hart，内核中 sstatus.SIE 为 0，tid 的检查现在不会失败，它保证
+// 快速路径在读 freelist 和写回之间没有别人改过这个 cache。
+
+#define TID_STEP 1
+
+static unsigned long next_tid(unsigned long tid) {
+  return tid + TID_STEP;
+}
+
+// pages per slab: at least 4 objects' worth (and 4 pages), picking the
+// size in [n, 2n) pages that leaves the least space after the last object
+static unsigned long slab_pages(size_t size) {
+  unsigned long n = (size * 4 - 1) / PAGE_SIZE + 1;
+  if (n < 4) n = 4;
+  unsigned long best = n;
+  for (unsigned long i = n; i < 2 * n; i++) {
+    if ((i << PAGE_SHIFT) % size < (best << PAGE_SHIFT) % size) best = i;
+  }
+  return best;
+}
+
+static int slab_objects(struct kmem_cache *cache) {
+  return (cache->nr_page_per_slub << PAGE_SHIFT) / cache->size;
+}
+
 void *cache_create(const char *name, size_t size, unsigned int aligns,
                    int flags, void *func(void *)) {
   struct kmem_cache *s = NULL;
@@ -157,6 +192,7 @@ void *cache_create(const char *name, size_t size, unsigned int aligns,
   /* init kmem_cache */
   s->name = name;
   s->init_func = (void *)func;
+  s->flags = flags;
   s->refcount = 1;
 
   s->min_partial = 4;
@@ -166,37 +202,85 @@ void *cache_create(const char *name, size_t size, unsigned int aligns,
   s->offset = 0;
   s->inuse = 0;
   s->align = aligns;
-  INIT_LIST_HEAD(&(s->list));
-  s->nr_page_per_slub = GET_NR_PAGE_PER_SLUB(s->size);
+  list_add_tail(&(s->list), &slab_caches);
+  s->nr_page_per_slub = slab_pages(s->size);
 
+  s->freelist = NULL;
+  s->page = NULL;
   s->nr_partial = 0;
+  INIT_LIST_HEAD(&(s->partial));
+  s->nr_slabs = 0;
+  s->total_objects = 0;
+  INIT_LIST_HEAD(&(s->full));
+  s->nr_allocs = 0;
+  s->nr_frees = 0;
 
   s->tid = cache_tid++;
   return s;
 }
 
+// give the objects left on the cpu freelist back to the active slab and
+// put it on the partial or full list
+static void deactivate_slab(struct kmem_cache *cache) {
+  struct page *page = cache->page;
+  if (page == NULL) return;
+  while (cache->freelist != NULL) {
+    void **object = cache->freelist;
+    cache->freelist = *object;
+    *object = page->freelist;
+    page->freelist = object;
+    page->count--;
+  }
+  if (page->freelist != NULL) {
+    list_add(&(page->slub_list), &(cache->partial));
+    cache->nr_partial++;
+  } else {
+    list_add(&(page->slub_list), &(cache->full));
+  }
+  cache->page = NULL;
+  cache->tid = next_tid(cache->tid);
+}
+
+// make page the active slab, all of its free objects move to the cpu
+// freelist
+static void activate_slab(struct kmem_cache *cache, struct page *page) {
+  cache->page = page;
+  cache->freelist = page->freelist;
+  page->freelist = NULL;
+  page->count = slab_objects(cache);
+  cache->tid = next_tid(cache->tid);
+}
+
+// allocate a new slab and make it the active one
 void *cache_alloc_pages(struct kmem_cache *cache) {
   void *p;
-  void *tp;
   struct page *page;
 
-  p = (void*)(alloc_pages(cache->nr_page_per_slub));
+  // every object is written by init_object_list or cleared on allocation
+  p = (void*)(alloc_pages_flags(cache->nr_page_per_slub, ALLOC_NOZERO));
   if (p == NULL) return NULL;
 
-  memset(p, 0, (cache->nr_page_per_slub) << PAGE_SHIFT);
   set_page_attr(p, cache->nr_page_per_slub, PAGE_SLUB);
-  tp = init_object_list(p, cache->size,
-                        ((cache->nr_page_per_slub) << PAGE_SHIFT));
-  cache->freelist = p;
+  init_object_list(p, cache->size, ((cache->nr_page_per_slub) << PAGE_SHIFT));
   page = ADDR_TO_PAGE(p);
   page->slub = cache;
+  page->freelist = p;
   INIT_LIST_HEAD(&(page->slub_list));
-  list_add_tail(&(cache->list), &(page->slub_list));
-  cache->nr_partial++;
+  cache->nr_slabs++;
+  cache->total_objects += slab_objects(cache);
+  activate_slab(cache, page);
 
   return p;
 }
 
+static void discard_slab(struct kmem_cache *cache, struct page *page) {
+  cache->nr_slabs--;
+  cache->total_objects -= slab_objects(cache);
+  free_pages(PAGE_TO_ADDR((void *)page));
+  // also takes page off the partial or full list
+  clear_page_attr(page);
+}
+
 static void inline free_slub_structure(struct kmem_cache *cache) {
   if (cache_region.freelist == NULL)
     cache_region.freelist = (void *)cache;
@@ -208,6 +292,31 @@ static void inline free_slub_structure(struct kmem_cache *cache) {
   return;
 }
 
+// under memory pressure: free empty slabs, min_partial included, until
+// nr pages are back. the active slabs are given up only in a second pass
+// when the partial lists were not enough. returns the number of pages freed
+static uint64_t slab_shrink(uint64_t nr) {
+  struct kmem_cache *s;
+  struct page *p, *t;
+  uint64_t pages = 0;
+  for (int pass = 0; pass < 2 && pages < nr; pass++) {
+    list_for_each_entry(s, &slab_caches, list) {
+      if (pass == 1) deactivate_slab(s);
+      list_for_each_entry_safe(p, t, &(s->partial), slub_list) {
+        if (pages >= nr) return pages;
+        if (p->count != 0) continue;
+        s->nr_partial--;
+        pages += s->nr_page_per_slub;
+        discard_slab(s, p);
+      }
+    }
+  }
+  return pages;
+}
+
+static struct shrinker slab_shrinker = {
+    .name = "slab", .seeks = 1, .scan = slab_shrink};
+
 void slub_init() {
   page_init();
   slub_structure_init();
@@ -215,6 +324,7 @@ void slub_init() {
     slub_allocator[i] = kmem_cache_create(kmem_cache_name[i],
                                           kmem_cache_objsize[i], 8, 0, NULL);
   }
+  register_shrinker(&slab_shrinker);
 
   return;
 }
@@ -235,69 +345,105 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t size,
 }
 
 int kmem_cache_destroy(struct kmem_cache *s) {
-  struct list_head *l;
-  struct page *p;
-  list_for_each(l, &(s->list)) {
-    if (list_entry(l, struct page, slub_list)->count != 0) return -1;
+  struct page *p, *t;
+  deactivate_slab(s);
+  if (!list_empty(&(s->full))) return -1;
+  list_for_each_entry(p, &(s->partial), slub_list) {
+    if (p->count != 0) return -1;
   }
-  list_for_each(l, &(s->list)) {
-    p = list_entry(l, struct page, slub_list);
-    free_pages(PAGE_TO_ADDR((void *)p));
-    clear_page_attr(p);
+  list_for_each_entry_safe(p, t, &(s->partial), slub_list) {
+    discard_slab(s, p);
   }
+  list_del(&(s->list));
   free_slub_structure(s);
   return 0;
 }
 
-void *kmem_cache_alloc(struct kmem_cache *cache) {
-  void *object = NULL;
-  struct list_head *l;
-  struct page *p;
-
-  if (cache->freelist == NULL) {
-    list_for_each(l, &(cache->list)) {
-      p = list_entry(l, struct page, slub_list);
-      if (p->freelist != NULL) {
-        cache->freelist = p->freelist;
-      }
-    }
-    if (cache->freelist == NULL && cache_alloc_pages(cache) == NULL)
-      return NULL;
+// the cpu freelist is empty: retire the active slab and take the first
+// partial one, or a new slab when there is none
+static void *slab_alloc_slow(struct kmem_cache *cache) {
+  deactivate_slab(cache);
+  if (!list_empty(&(cache->partial))) {
+    struct page *page = list_first_entry(&(cache->partial), struct page, slub_list);
+    list_del_init(&(page->slub_list));
+    cache->nr_partial--;
+    activate_slab(cache, page);
+  } else if (cache_alloc_pages(cache) == NULL) {
+    return NULL;
   }
+  void **object = cache->freelist;
+  cache->freelist = *object;
+  cache->tid = next_tid(cache->tid);
+  return object;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+  void **object;
+  unsigned long tid;
 
+redo:
+  tid = cache->tid;
   object = cache->freelist;
-  cache->freelist = *(cache->freelist);
-  (ADDR_TO_PAGE(object)->header)->count++;
+  if (object == NULL) {
+    object = slab_alloc_slow(cache);
+    if (object == NULL) return NULL;
+  } else {
+    void *next = *object;
+    // somebody else used the freelist after we read it
+    if (tid != cache->tid) goto redo;
+    cache->freelist = next;
+    cache->tid = next_tid(tid);
+  }
+
+  cache->nr_allocs++;
   if (cache->init_func != NULL)
     cache->init_func(object);
-  else {
+  else if (!(cache->flags & SLAB_NOZERO)) {
     memset(object, 0, cache->size);
   }
   return object;
 }
 
+// an object of a slab that is not active goes back to its page. a slab
+// that becomes empty is freed once the cache has enough partial slabs
+static void slab_free_slow(struct kmem_cache *s, struct page *page, void **obj) {
+  bool was_full = page->freelist == NULL;
+  *obj = page->freelist;
+  page->freelist = obj;
+  page->count--;
+  if (page->count == 0 && s->nr_partial >= s->min_partial) {
+    if (!was_full) s->nr_partial--;
+    discard_slab(s, page);
+  } else if (was_full) {
+    list_move(&(page->slub_list), &(s->partial));
+    s->nr_partial++;
+  }
+}
+
 void kmem_cache_free(void *obj) {
   struct page *page = ADDR_TO_PAGE(obj)->header;
-  struct kmem_cache *s;
-  void *p;
-
-  s = page->slub;
-  if (page->freelist == NULL) {
-    page->freelist = obj;
-  } else {
-    *((void **)obj) = *(void **)(page->freelist);
-    *(void **)(page->freelist) = (void *)obj;
-  }
-  page = page->header;
-  page->count--;
-  if (page->count == 0 && s->nr_partial > s->min_partial) {
-    free_pages((uint64_t)obj);
-    clear_page_attr(page);
-    s->nr_partial--;
+  struct kmem_cache *s = page->slub;
+  unsigned long tid;
+
+  s->nr_frees++;
+redo:
+  tid = s->tid;
+  if (page != s->page) {
+    slab_free_slow(s, page, obj);
+    return;
   }
+  *(void **)obj = s->freelist;
+  if (tid != s->tid) goto redo;
+  s->freelist = obj;
+  s->tid = next_tid(tid);
+}
 
-  return;
+static void *kmalloc_pages(size_t size) {
+  void *p = (void *)alloc_pages((size - 1) / PAGE_SIZE + 1);
+  if (p != NULL) set_page_attr(p, (size - 1) / PAGE_SIZE + 1, PAGE_BUDDY);
+  return p;
 }
+
 void *kmalloc(size_t size) {
   int objindex;
   void *p = NULL;
@@ -314,6 +460,7 @@ void *kmalloc(size_t size) {
     if(size <= kmem_cache_objsize[objindex]) {
       // TODO:
       p = kmem_cache_alloc(slub_allocator[objindex]);
+      if (p != NULL) kmalloc_requested[objindex] += size;
       return p;
     }
   }
@@ -321,14 +468,46 @@ void *kmalloc(size_t size) {
   // size 若不在 kmem_cache_objsize 范围之内，则使用 buddy system 来分配内存
   if (objindex >= NR_PARTIAL) {
     // TODO:
-    p = alloc_pages((size - 1) / PAGE_SIZE + 1);
-
-    set_page_attr(p, (size - 1) / PAGE_SIZE + 1, PAGE_BUDDY);
+    p = kmalloc_pages(size);
+    if (p != NULL) {
+      kmalloc_requested[NR_PARTIAL] += size;
+      kmalloc_large_allocs++;
+      kmalloc_large_pages += (size - 1) / PAGE_SIZE + 1;
+    }
   }
 
   return p;
 }
 
+// x / y in tenths of a percent
+static int permille(unsigned long x, unsigned long y) {
+  return y ? (int)(x * 1000 / y) : 0;
+}
+
+void kmalloc_stat() {
+  for (int i = 0; i < NR_PARTIAL; i++) {
+    struct kmem_cache *s = slub_allocator[i];
+    unsigned long slab_bytes = s->nr_slabs * (s->nr_page_per_slub << PAGE_SHIFT);
+    // internal: object size beyond the bytes asked for. unused: slab space
+    // not holding a live object, free objects and the tail of each slab
+    int internal = 1000 - permille(kmalloc_requested[i], s->nr_allocs * s->size);
+    int unused = 1000 - permille((s->nr_allocs - s->nr_frees) * s->size, slab_bytes);
+    if (s->nr_allocs == 0) internal = 0;
+    if (slab_bytes == 0) unused = 0;
+    printf("[kmalloc] %s allocs %d frees %d slabs %d x %d pages "
+           "internal frag %d.%d%% unused %d.%d%%\n",
+           s->name, (int)s->nr_allocs, (int)s->nr_frees, (int)s->nr_slabs,
+           (int)s->nr_page_per_slub, internal / 10, internal % 10, unused / 10,
+           unused % 10);
+  }
+  unsigned long large_bytes = kmalloc_large_pages << PAGE_SHIFT;
+  int internal = 1000 - permille(kmalloc_requested[NR_PARTIAL], large_bytes);
+  if (large_bytes == 0) internal = 0;
+  printf("[kmalloc] pages                 allocs %d pages %d internal frag %d.%d%%\n",
+         (int)kmalloc_large_allocs, (int)kmalloc_large_pages, internal / 10,
+         internal % 10);
+}
+
 void kfree(const void *addr) {
   struct page *page;
 
@@ -353,3 +532,27 @@ void kfree(const void *addr) {
 
   return;
 }
+
+// reference counts of user pages shared copy-on-write. a page mapped once
+// keeps refcount 0, so pages from alloc_pages need no setup.
+void page_ref_inc(uint64_t pa) {
+  struct page *page = ADDR_TO_PAGE(pa);
+  page->refcount = (page->refcount ? page->refcount : 1) + 1;
+}
+
+// drop one mapping of the page, returns 1 when it was the last one and the
+// page should be freed
+bool page_ref_dec(uint64_t pa) {
+  struct page *page = ADDR_TO_PAGE(pa);
+  if (page->refcount <= 1) {
+    page->refcount = 0;
+    return 1;
+  }
+  page->refcount--;
+  return 0;
+}
+
+int page_ref(uint64_t pa) {
+  int refcount = ADDR_TO_PAGE(pa)->refcount;
+  return refcount ? refcount : 1;
+}
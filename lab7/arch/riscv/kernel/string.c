@@ -0,0 +1,186 @@
+#include "mm.h"
+#include "riscv.h"
+#include "stdio.h"
+
+// --------------------------------------------------
+// ------------------ Memory Copy -------------------
+// --------------------------------------------------
+// 按 8 字节的字拷贝和填充：先按字节处理到 dst 对齐，主循环每次 8 个字，
+// 剩下的字和字节再单独处理。src 与 dst 对 8 取模不同时没法都对齐，退回按
+// 字节拷贝。-march 含 V 扩展时 (编译器定义 __riscv_vector) 较长的区间用
+// RVV 循环，每次处理 vsetvli 给出的长度，不需要关心对齐和尾部。
+
+#define WORD_SIZE 8
+#define WORD_MASK (WORD_SIZE - 1)
+// 短于这个长度时向量循环的启动开销不划算
+#define VECTOR_MIN 64
+
+#ifdef __riscv_vector
+static void vector_copy(char *d, const char *s, size_t n) {
+  size_t vl;
+  while (n > 0) {
+    asm volatile("vsetvli %0, %1, e8, m8, ta, ma\n"
+                 "vle8.v v0, (%2)\n"
+                 "vse8.v v0, (%3)\n"
+                 : "=&r"(vl)
+                 : "r"(n), "r"(s), "r"(d)
+                 : "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7", "memory");
+    d += vl;
+    s += vl;
+    n -= vl;
+  }
+}
+
+static void vector_set(char *d, int c, size_t n) {
+  size_t vl;
+  while (n > 0) {
+    asm volatile("vsetvli %0, %1, e8, m8, ta, ma\n"
+                 "vmv.v.x v0, %2\n"
+                 "vse8.v v0, (%3)\n"
+                 : "=&r"(vl)
+                 : "r"(n), "r"(c), "r"(d)
+                 : "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7", "memory");
+    d += vl;
+    n -= vl;
+  }
+}
+#endif
+
+static void byte_copy(char *d, const char *s, size_t n) {
+  while (n--) *d++ = *s++;
+}
+
+void *memcpy(void *dst, const void *src, size_t size) {
+  char *d = dst;
+  const char *s = src;
+#ifdef __riscv_vector
+  if (size >= VECTOR_MIN) {
+    vector_copy(d, s, size);
+    return dst;
+  }
+#endif
+  if ((((uint64_t)d ^ (uint64_t)s) & WORD_MASK) != 0 || size < WORD_SIZE) {
+    byte_copy(d, s, size);
+    return dst;
+  }
+  while ((uint64_t)d & WORD_MASK) {
+    *d++ = *s++;
+    size--;
+  }
+  uint64_t *dw = (uint64_t *)d;
+  const uint64_t *sw = (const uint64_t *)s;
+  for (; size >= 8 * WORD_SIZE; size -= 8 * WORD_SIZE, dw += 8, sw += 8) {
+    uint64_t w0 = sw[0], w1 = sw[1], w2 = sw[2], w3 = sw[3];
+    uint64_t w4 = sw[4], w5 = sw[5], w6 = sw[6], w7 = sw[7];
+    dw[0] = w0;
+    dw[1] = w1;
+    dw[2] = w2;
+    dw[3] = w3;
+    dw[4] = w4;
+    dw[5] = w5;
+    dw[6] = w6;
+    dw[7] = w7;
+  }
+  for (; size >= WORD_SIZE; size -= WORD_SIZE) *dw++ = *sw++;
+  byte_copy((char *)dw, (const char *)sw, size);
+  return dst;
+}
+
+// copies correctly when the ranges overlap
+void *memmove(void *dst, const void *src, size_t size) {
+  char *d = dst;
+  const char *s = src;
+  // forward copying reads each byte before it can be overwritten
+  if (d <= s || d >= s + size) return memcpy(dst, src, size);
+  d += size;
+  s += size;
+  if ((((uint64_t)d ^ (uint64_t)s) & WORD_MASK) == 0) {
+    while (size > 0 && ((uint64_t)d & WORD_MASK)) {
+      *--d = *--s;
+      size--;
+    }
+    for (; size >= WORD_SIZE; size -= WORD_SIZE) {
+      d -= WORD_SIZE;
+      s -= WORD_SIZE;
+      *(uint64_t *)d = *(const uint64_t *)s;
+    }
+  }
+  while (size--) *--d = *--s;
+  return dst;
+}
+
+void *memset(void *dst, int c, size_t n) {
+  char *d = dst;
+#ifdef __riscv_vector
+  if (n >= VECTOR_MIN) {
+    vector_set(d, c, n);
+    return dst;
+  }
+#endif
+  while (n > 0 && ((uint64_t)d & WORD_MASK)) {
+    *d++ = c;
+    n--;
+  }
+  uint64_t w = (uint8_t)c * 0x0101010101010101ULL;
+  uint64_t *dw = (uint64_t *)d;
+  for (; n >= 8 * WORD_SIZE; n -= 8 * WORD_SIZE, dw += 8) {
+    dw[0] = w;
+    dw[1] = w;
+    dw[2] = w;
+    dw[3] = w;
+    dw[4] = w;
+    dw[5] = w;
+    dw[6] = w;
+    dw[7] = w;
+  }
+  for (; n >= WORD_SIZE; n -= WORD_SIZE) *dw++ = w;
+  d = (char *)dw;
+  while (n--) *d++ = c;
+  return dst;
+}
+
+// --------------------------------------------------
+// ---------------- Memory Benchmark ----------------
+// --------------------------------------------------
+// 用 rdcycle/rdtime 测 memcpy、memset 和逐字节拷贝的吞吐，结果为每周期字节数
+
+#define BENCH_PAGES 16
+#define BENCH_BYTES (BENCH_PAGES * PAGE_SIZE)
+
+static void bench_report(const char *name, uint64_t size, uint64_t bytes,
+                         uint64_t cycles, uint64_t ticks) {
+  if (cycles == 0) cycles = 1;
+  uint64_t x100 = bytes * 100 / cycles;
+  printf("[bench] %s %d B: %d.%d%d bytes/cycle (%d cycles, %d ticks)\n", name,
+         (int)size, (int)(x100 / 100), (int)(x100 / 10 % 10), (int)(x100 % 10),
+         (int)cycles, (int)ticks);
+}
+
+void mem_bench() {
+  static const uint64_t sizes[] = {64, 512, PAGE_SIZE, BENCH_BYTES};
+  char *src = (char *)alloc_pages(BENCH_PAGES);
+  char *dst = (char *)alloc_pages(BENCH_PAGES);
+  if (src == NULL || dst == NULL) return;
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    uint64_t size = sizes[i];
+    uint64_t rounds = BENCH_BYTES * 4 / size;
+    uint64_t c0, t0;
+
+    c0 = rdcycle();
+    t0 = rdtime();
+    for (uint64_t r = 0; r < rounds; r++) byte_copy(dst, src, size);
+    bench_report("bytecopy", size, rounds * size, rdcycle() - c0, rdtime() - t0);
+
+    c0 = rdcycle();
+    t0 = rdtime();
+    for (uint64_t r = 0; r < rounds; r++) memcpy(dst, src, size);
+    bench_report("memcpy  ", size, rounds * size, rdcycle() - c0, rdtime() - t0);
+
+    c0 = rdcycle();
+    t0 = rdtime();
+    for (uint64_t r = 0; r < rounds; r++) memset(dst, r, size);
+    bench_report("memset  ", size, rounds * size, rdcycle() - c0, rdtime() - t0);
+  }
+  free_pages((uint64_t)src);
+  free_pages((uint64_t)dst);
+}
@@ -9,13 +9,16 @@
 #include "slub.h"
 #include "mm.h"
 #include "vm.h"
+#include "elf.h"
 
 extern uint64_t text_start;
 extern uint64_t rodata_start;
 extern uint64_t data_start;
-extern uint64_t user_program_start;
 extern void trap_s_bottom(void);
 
+// a path argument is faulted in up to this many bytes before sfs_* reads it
+#define PATH_PREFAULT_LEN 256
+
 int strcmp(const char *a, const char *b) {
   while (*a && *b) {
     if (*a < *b)
@@ -32,19 +35,6 @@ int strcmp(const char *a, const char *b) {
   return 0;
 }
 
-uint64_t get_program_address(const char * name) {
-    uint64_t offset = 0;
-    if (strcmp(name, "hello") == 0) offset = PAGE_SIZE * 2;
-    else if (strcmp(name, "read") == 0) offset = PAGE_SIZE * 4;
-    else if (strcmp(name, "test") == 0) offset = PAGE_SIZE * 6;
-    else if (strcmp(name, "fssh") == 0) offset = PAGE_SIZE * 7;
-    else {
-        printf("Unknown user program %s\n", name);
-        while (1);
-    }
-    return PHYSICAL_ADDR((uint64_t)(&user_program_start) + offset);
-}
-
 struct ret_info syscall(uint64_t syscall_num, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t sp) {
     uint64_t* sp_ptr = (uint64_t*)(sp);
 
@@ -88,31 +78,13 @@ struct ret_info syscall(uint64_t syscall_num, uint64_t arg0, uint64_t arg1, uint
         task[i]->blocked = 0;
         task[i]->pid = i;
 
-        uint64_t root_page_table = alloc_page();
-        task[i]->mm.user_program_start = current->mm.user_program_start;
-        task[i]->satp = root_page_table >> 12 | 0x8000000000000000 | (((uint64_t) (task[i]->pid))  << 44);
-        create_mapping((uint64_t*)root_page_table, 0x1000000, task[i]->mm.user_program_start, PAGE_SIZE * 2, PTE_V | PTE_R | PTE_X | PTE_U | PTE_W);
-        // 调用 create_mapping 函数将虚拟地址 0xffffffc000000000 开始的 16 MB 空间映射到起始物理地址为 0x80000000 的 16MB 空间
-        create_mapping((uint64_t*)root_page_table, 0xffffffc000000000, 0x80000000, 16 * 1024 * 1024, PTE_V | PTE_R | PTE_W | PTE_X);
-        // 修改对内核空间不同 section 所在页属性的设置，完成对不同section的保护，其中text段的权限为 r-x, rodata 段为 r--, 其他段为 rw-。
-        create_mapping((uint64_t*)root_page_table, 0xffffffc000000000, 0x80000000, PHYSICAL_ADDR((uint64_t)&rodata_start) - 0x80000000, PTE_V | PTE_R | PTE_X);
-        create_mapping((uint64_t*)root_page_table, (uint64_t)&rodata_start, PHYSICAL_ADDR((uint64_t)&rodata_start), (uint64_t)&data_start - (uint64_t)&rodata_start, PTE_V | PTE_R);
-        create_mapping((uint64_t*)root_page_table, (uint64_t)&data_start, PHYSICAL_ADDR((uint64_t)&data_start), (uint64_t)&_end - (uint64_t)&data_start, PTE_V | PTE_R | PTE_W);
-        // 对内核起始地址 0x80000000 的16MB空间做等值映射（将虚拟地址 0x80000000 开始的 16 MB 空间映射到起始物理地址为 0x80000000 的 16MB 空间）
-        create_mapping((uint64_t*)root_page_table, 0x80000000, 0x80000000, 16 * 1024 * 1024, PTE_V | PTE_R | PTE_W | PTE_X);
-        // 修改对内核空间不同 section 所在页属性的设置，完成对不同section的保护，其中text段的权限为 r-x, rodata 段为 r--, 其他段为 rw-。
-        create_mapping((uint64_t*)root_page_table, 0x80000000, 0x80000000, PHYSICAL_ADDR((uint64_t)&rodata_start) - 0x80000000, PTE_V | PTE_R | PTE_X);
-        create_mapping((uint64_t*)root_page_table, PHYSICAL_ADDR((uint64_t)&rodata_start), PHYSICAL_ADDR((uint64_t)&rodata_start), (uint64_t)&data_start - (uint64_t)&rodata_start, PTE_V | PTE_R);
-        create_mapping((uint64_t*)root_page_table, PHYSICAL_ADDR((uint64_t)&data_start), PHYSICAL_ADDR((uint64_t)&data_start), (uint64_t)&_end - (uint64_t)&data_start, PTE_V | PTE_R | PTE_W);
-        // 将必要的硬件地址（如 0x10000000 为起始地址的 UART ）进行等值映射 ( 可以映射连续 1MB 大小 )，无偏移，3 为映射的读写权限
-        create_mapping((uint64_t*)root_page_table, 0x10000000, 0x10000000, 1 * 1024 * 1024, PTE_V | PTE_R | PTE_W | PTE_X);
-        create_mapping((uint64_t*)root_page_table, 0x0c000000L, 0x0c000000L, 20 * 1024 * 1024, PTE_V | PTE_R | PTE_W | PTE_X);
+        // 内核部分的页表与 kernel_pgtbl 共享
+        uint64_t root_page_table = (uint64_t)pgtbl_alloc();
+        task[i]->mm.asid = asid_alloc();
+        task[i]->satp = asid_satp((uint64_t*)root_page_table, task[i]->mm.asid);
 
-        uint64_t physical_stack = alloc_pages(2);
-        task[i]->mm.user_stack = physical_stack;
+        // the user stack is one of the areas below, shared copy-on-write
         task[i]->sscratch = read_csr(sscratch);
-        create_mapping((uint64_t*)root_page_table, 0x1002000, physical_stack, PAGE_SIZE * 2, PTE_V | PTE_R | PTE_W | PTE_U);
-        memcpy((uint64_t *)physical_stack, (uint64_t *)current->mm.user_stack, PAGE_SIZE * 2);
 
         task[i]->mm.vm = kmalloc(sizeof(struct vm_area_struct));
         INIT_LIST_HEAD(&(task[i]->mm.vm->vm_list));
@@ -121,12 +93,7 @@ struct ret_info syscall(uint64_t syscall_num, uint64_t arg0, uint64_t arg1, uint
             struct vm_area_struct * copy = kmalloc(sizeof(struct vm_area_struct));
             memcpy(copy, vma, sizeof(struct vm_area_struct));
             list_add(&(copy->vm_list), &task[i]->mm.vm->vm_list);
-            if (vma->mapped) {
-                uint64_t pa = alloc_pages((vma->vm_end - vma->vm_start) / PAGE_SIZE);
-                create_mapping((uint64_t*)root_page_table, vma->vm_start, pa, vma->vm_end - vma->vm_start, vma->vm_flags);
-                uint64_t pte = get_pte((current->satp & ((1ULL << 44) - 1)) << 12, vma->vm_start);
-                memcpy((uint64_t *)pa, (uint64_t *)((pte >> 10) << 12), vma->vm_end - vma->vm_start);
-            }
+            vma_copy(copy, vma, (uint64_t*)root_page_table, (uint64_t*)((current->satp & ((1ULL << 44) - 1)) << 12));
         }
 
         sp_ptr[4] = task[i]->pid;
@@ -145,29 +112,53 @@ struct ret_info syscall(uint64_t syscall_num, uint64_t arg0, uint64_t arg1, uint
         // 1. free current process vm_area_struct and it's mapping area
         // 2. reset user stack
         // 3. create mapping for new user program address
-        // 4. set sepc = 0x1000000
+        // 4. set sepc to the entry of the new program
+
+        // the name may live on the user stack, which goes away below
+        char name[EXEC_NAME_LEN];
+        vma_prefault(arg0, EXEC_NAME_LEN, 0);
+        int n = 0;
+        while (n < EXEC_NAME_LEN - 1 && ((char *)arg0)[n]) {
+            name[n] = ((char *)arg0)[n];
+            n++;
+        }
+        name[n] = '\0';
+
+        // a program that cannot be loaded leaves the caller running
+        struct elf_image img;
+        sfs_lock();
+        int err = elf_open(&img, name);
+        sfs_unlock();
+        if (err) {
+            ret.a0 = -1;
+            sp_ptr[4] = ret.a0;
+            sp_ptr[16] += 4;
+            break;
+        }
 
         uint64_t root_page_table = (current->satp & ((1ULL << 44) - 1)) << 12;
-        struct vm_area_struct* vma;
-        list_for_each_entry(vma, &current->mm.vm->vm_list, vm_list) {
-            if (vma->mapped == 1) {
-                uint64_t pte = get_pte((uint64_t*)root_page_table, vma->vm_start);
-                free_pages((pte >> 10) << 12);
-            }
-            create_mapping((uint64_t*)root_page_table, vma->vm_start, 0, (vma->vm_end - vma->vm_start), 0);
+        struct vm_area_struct *vma, *tmp;
+        list_for_each_entry_safe(vma, tmp, &current->mm.vm->vm_list, vm_list) {
+            vma_unmap(vma, (uint64_t*)root_page_table);
             list_del(&(vma->vm_list));
             kfree(vma);
         }
 
-        write_csr(sscratch, 0x1002000 + PAGE_SIZE * 2);
-
-        current->mm.user_program_start = get_program_address((char *)arg0);
-        create_mapping((uint64_t*)root_page_table, 0x1000000, current->mm.user_program_start, PAGE_SIZE * 2, PTE_V | PTE_R | PTE_X | PTE_U | PTE_W);
-
-        asm volatile ("sfence.vma");
-        sp_ptr[16] = 0x1000000;
+        vma_add(&current->mm, USER_STACK_START, USER_STACK_SIZE, PTE_V | PTE_R | PTE_W | PTE_U);
+        write_csr(sscratch, USER_STACK_START + USER_STACK_SIZE);
 
-        break;
+        sfs_lock();
+        err = elf_map(&img, &current->mm, (uint64_t*)root_page_table);
+        elf_close(&img);
+        sfs_unlock();
+        flush_tlb_mm();
+        if (err == 0) {
+            sp_ptr[16] = img.ehdr.e_entry;
+            break;
+        }
+        // the old program is gone already, the task can only exit
+        printf("exec %s failed\n", name);
+        // fall through
     }
     case SYS_EXIT: {
         // TODO:
@@ -177,24 +168,20 @@ struct ret_info syscall(uint64_t syscall_num, uint64_t arg0, uint64_t arg1, uint
         // 4. clear current task, set current task->counter = 0
         // 5. call schedule
 
+        // the user stack is freed with the other areas
         uint64_t root_page_table = (current->satp & ((1ULL << 44) - 1)) << 12;
-        struct vm_area_struct* vma;
-        list_for_each_entry(vma, &current->mm.vm->vm_list, vm_list) {
-            if (vma->mapped == 1) {
-                uint64_t pte = get_pte((uint64_t*)root_page_table, vma->vm_start);
-                free_pages((pte >> 10) << 12);
-            }
-            create_mapping((uint64_t*)root_page_table, vma->vm_start, 0, (vma->vm_end - vma->vm_start), 0);
+        struct vm_area_struct *vma, *tmp;
+        list_for_each_entry_safe(vma, tmp, &current->mm.vm->vm_list, vm_list) {
+            vma_unmap(vma, (uint64_t*)root_page_table);
             list_del(&(vma->vm_list));
             kfree(vma);
         }
-        kfree(&(current->mm.vm));
+        kfree(current->mm.vm);
         current->mm.vm = NULL;
 
-        free_pages(current->mm.user_stack);
-        current->mm.user_stack = 0;
-
-        free_pages(root_page_table);
+        // leave the page table before it is freed, the kernel part is global
+        write_csr(satp, asid_satp(kernel_pgtbl, 0));
+        pgtbl_free((uint64_t*)root_page_table);
 
         current->counter = 0;
         schedule(0);
@@ -240,6 +227,13 @@ struct ret_info syscall(uint64_t syscall_num, uint64_t arg0, uint64_t arg1, uint
         break;
     }
     case SYS_MMAP: {
+        // the kernel's page tables are shared, user areas must stay out of them
+        if (kernel_range(arg0, arg0 + arg1)) {
+            ret.a0 = -1;
+            sp_ptr[4] = ret.a0;
+            sp_ptr[16] += 4;
+            break;
+        }
         struct vm_area_struct* vma = (struct vm_area_struct*)kmalloc(sizeof(struct vm_area_struct));
         if (vma == NULL) {
             ret.a0 = -1;
@@ -248,10 +242,34 @@ struct ret_info syscall(uint64_t syscall_num, uint64_t arg0, uint64_t arg1, uint
         vma->vm_start = arg0;
         vma->vm_end = arg0 + arg1;
         vma->vm_flags = arg2;
-        vma->mapped = 0;
+        vma->vm_ino = 0;
+        vma->vm_offset = 0;
+        vma->vm_shared = 0;
+        vma->vm_image = 0;
+        // arg3 flags, arg4 fd, arg5 file offset
+        if ((arg3 & (MAP_SHARED | MAP_PRIVATE)) && !(arg3 & MAP_ANONYMOUS)) {
+            sfs_lock();
+            int err = sfs_mmap(arg4, vma, arg5, (arg3 & MAP_SHARED) != 0);
+            sfs_unlock();
+            if (err) {
+                kfree(vma);
+                ret.a0 = -1;
+                sp_ptr[4] = ret.a0;
+                sp_ptr[16] += 4;
+                break;
+            }
+        }
+        if (vma_init(vma) != 0) {
+            kfree(vma);
+            ret.a0 = -1;
+            sp_ptr[4] = ret.a0;
+            sp_ptr[16] += 4;
+            break;
+        }
         list_add(&(vma->vm_list), &(current->mm.vm->vm_list));
 
         ret.a0 = vma->vm_start;
+        sp_ptr[4] = ret.a0;
         sp_ptr[16] += 4;
         break;
     }
@@ -260,59 +278,92 @@ struct ret_info syscall(uint64_t syscall_num, uint64_t arg0, uint64_t arg1, uint
         struct vm_area_struct* vma;
         list_for_each_entry(vma, &current->mm.vm->vm_list, vm_list) {
             if (vma->vm_start == arg0 && vma->vm_end == arg0 + arg1) {
-                if (vma->mapped == 1) {
-                    uint64_t pte = get_pte((current->satp & ((1ULL << 44) - 1)) << 12, vma->vm_start);
-                    free_pages((pte >> 10) << 12);
-                }
-                create_mapping((current->satp & ((1ULL << 44) - 1)) << 12, vma->vm_start, 0, (vma->vm_end - vma->vm_start), 0);
+                vma_unmap(vma, (uint64_t*)((current->satp & ((1ULL << 44) - 1)) << 12));
                 list_del(&(vma->vm_list));
                 kfree(vma);
+                // only this address space's entries for the area
+                flush_tlb_range(arg0, arg0 + arg1);
 
                 ret.a0 = 0;
                 break;
             }
         }
-        // flash the TLB
-        asm volatile ("sfence.vma");
+        sp_ptr[4] = ret.a0;
         sp_ptr[16] += 4;
         break;
     }
     case SFS_OPEN: {
+        vma_prefault(arg0, PATH_PREFAULT_LEN, 0);
+        sfs_lock();
         ret.a0 = sfs_open((const char *)arg0, arg1);
+        sfs_unlock();
         sp_ptr[4] = ret.a0;
         sp_ptr[16] += 4;
         break;
     }
     case SFS_READ: {
+        // the kernel must not fault on the user buffer
+        vma_prefault(arg1, arg2, 1);
+        sfs_lock();
         ret.a0 = sfs_read(arg0, (const char *)arg1, arg2);
+        sfs_unlock();
         sp_ptr[4] = ret.a0;
         sp_ptr[16] += 4;
         break;
     }
     case SFS_WRITE: {
+        // the kernel must not fault on the user buffer
+        vma_prefault(arg1, arg2, 0);
+        sfs_lock();
         ret.a0 = sfs_write(arg0, (const char *)arg1, arg2);
+        sfs_unlock();
         sp_ptr[4] = ret.a0;
         sp_ptr[16] += 4;
         break;
     }
     case SFS_SEEK: {
+        sfs_lock();
         ret.a0 = sfs_seek(arg0, arg1, arg2);
+        sfs_unlock();
         sp_ptr[4] = ret.a0;
         sp_ptr[16] += 4;
         break;
     }
     case SFS_GET_FILES: {
+        // the files[] array is faulted in entry by entry by sfs_get_files
+        vma_prefault(arg0, PATH_PREFAULT_LEN, 0);
+        vma_prefault(arg1, sizeof(char *), 0);
+        sfs_lock();
         ret.a0 = sfs_get_files((const char *)arg0, (char **)arg1);
+        sfs_unlock();
         sp_ptr[4] = ret.a0;
         sp_ptr[16] += 4;
         break;
     }
     case SFS_CLOSE: {
+        sfs_lock();
         ret.a0 = sfs_close(arg0);
+        sfs_unlock();
         sp_ptr[4] = ret.a0;
         sp_ptr[16] += 4;
         break;
     }
+    case SYS_KSTAT: {
+        // compare before and after fork/exec/exit cycles to find leaks
+        printf("[mm] pages in use %d\n", alloced_page_num());
+        pgtbl_stat();
+        zero_pool_stat();
+        kmalloc_stat();
+        shrinker_stat();
+        sfs_lock();
+        if (__sfs != NULL) {
+            buffer_stat();
+            dcache_stat();
+        }
+        sfs_unlock();
+        sp_ptr[16] += 4;
+        break;
+    }
     default:
         printf("Unknown syscall! syscall_num = %d\n", syscall_num);
         while(1);
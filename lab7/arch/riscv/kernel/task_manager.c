@@ -1,6 +1,7 @@
 #include "task_manager.h"
 
 #include "vm.h"
+#include "elf.h"
 #include "mm.h"
 #include "stdio.h"
 
@@ -11,7 +12,6 @@ extern uint64_t text_start;
 extern uint64_t rodata_start;
 extern uint64_t data_start;
 extern uint64_t _end;
-extern uint64_t user_program_start;
 
 // get pid of current process
 int getpid() {
@@ -33,8 +33,6 @@ void task_init(void) {
 
   task[0]->mm.vm = kmalloc(sizeof(struct vm_area_struct));
   INIT_LIST_HEAD(&(task[0]->mm.vm->vm_list));
-    
-  uint64_t task_addr = PHYSICAL_ADDR((uint64_t)&user_program_start);
 
   // DONE: 完成用户栈的分配，并创建页表项，将用户栈映射到实际的物理地址
   // 1. 为用户栈分配物理页面，使用alloc_page函数
@@ -47,32 +45,23 @@ void task_init(void) {
   // 8. 对内核起始地址 0x80000000 的16MB空间做等值映射（将虚拟地址 0x80000000 开始的 16 MB 空间映射到起始物理地址为 0x80000000 的 16MB 空间），PTE_V | PTE_R | PTE_W | PTE_X 为映射的读写权限。
   // 9. 修改对内核空间不同 section 所在页属性的设置，完成对不同section的保护，其中text段的权限为 r-x, rodata 段为 r--, 其他段为 rw-，注意上述两个映射都需要做保护。
   // 10. 将必要的硬件地址（如 0x10000000 为起始地址的 UART ）进行等值映射 ( 可以映射连续 1MB 大小 )，无偏移，PTE_V | PTE_R 为映射的读写权限
-  uint64_t physical_stack = alloc_pages(2);
-  uint64_t root_page_table = alloc_page();
-  task[0]->mm.user_stack = physical_stack;
-  task[0]->mm.user_program_start = task_addr;
-  task[0]->sscratch = (uint64_t)0x1002000 + PAGE_SIZE * 2;
-  task[0]->satp = root_page_table >> 12 | 0x8000000000000000 | (((uint64_t) (new_task->pid))  << 44);
-  create_mapping((uint64_t*)root_page_table, 0x1002000, physical_stack, PAGE_SIZE * 2, PTE_V | PTE_R | PTE_W | PTE_U);
-  create_mapping((uint64_t*)root_page_table, 0x1000000, task_addr, PAGE_SIZE * 2, PTE_V | PTE_R | PTE_X | PTE_U | PTE_W);
+  // 内核部分的页表与 kernel_pgtbl 共享
+  uint64_t root_page_table = (uint64_t)pgtbl_alloc();
+  // the user stack is an anonymous area, its pages are faulted in on use
+  vma_add(&task[0]->mm, USER_STACK_START, USER_STACK_SIZE, PTE_V | PTE_R | PTE_W | PTE_U);
+  task[0]->sscratch = (uint64_t)USER_STACK_START + USER_STACK_SIZE;
+  task[0]->mm.asid = asid_alloc();
+  task[0]->satp = asid_satp((uint64_t*)root_page_table, task[0]->mm.asid);
 
-  // 调用 create_mapping 函数将虚拟地址 0xffffffc000000000 开始的 16 MB 空间映射到起始物理地址为 0x80000000 的 16MB 空间
-  create_mapping((uint64_t*)root_page_table, 0xffffffc000000000, 0x80000000, 16 * 1024 * 1024, PTE_V | PTE_R | PTE_W | PTE_X);
-  // 修改对内核空间不同 section 所在页属性的设置，完成对不同section的保护，其中text段的权限为 r-x, rodata 段为 r--, 其他段为 rw-。
-  create_mapping((uint64_t*)root_page_table, 0xffffffc000000000, 0x80000000, PHYSICAL_ADDR((uint64_t)&rodata_start) - 0x80000000, PTE_V | PTE_R | PTE_X);
-  create_mapping((uint64_t*)root_page_table, (uint64_t)&rodata_start, PHYSICAL_ADDR((uint64_t)&rodata_start), (uint64_t)&data_start - (uint64_t)&rodata_start, PTE_V | PTE_R);
-  create_mapping((uint64_t*)root_page_table, (uint64_t)&data_start, PHYSICAL_ADDR((uint64_t)&data_start), (uint64_t)&_end - (uint64_t)&data_start, PTE_V | PTE_R | PTE_W);
-  
-  // 对内核起始地址 0x80000000 的16MB空间做等值映射（将虚拟地址 0x80000000 开始的 16 MB 空间映射到起始物理地址为 0x80000000 的 16MB 空间）
-  create_mapping((uint64_t*)root_page_table, 0x80000000, 0x80000000, 16 * 1024 * 1024, PTE_V | PTE_R | PTE_W | PTE_X);
-  // 修改对内核空间不同 section 所在页属性的设置，完成对不同section的保护，其中text段的权限为 r-x, rodata 段为 r--, 其他段为 rw-。
-  create_mapping((uint64_t*)root_page_table, 0x80000000, 0x80000000, PHYSICAL_ADDR((uint64_t)&rodata_start) - 0x80000000, PTE_V | PTE_R | PTE_X);
-  create_mapping((uint64_t*)root_page_table, PHYSICAL_ADDR((uint64_t)&rodata_start), PHYSICAL_ADDR((uint64_t)&rodata_start), (uint64_t)&data_start - (uint64_t)&rodata_start, PTE_V | PTE_R);
-  create_mapping((uint64_t*)root_page_table, PHYSICAL_ADDR((uint64_t)&data_start), PHYSICAL_ADDR((uint64_t)&data_start), (uint64_t)&_end - (uint64_t)&data_start, PTE_V | PTE_R | PTE_W);
-  
-  // 将必要的硬件地址（如 0x10000000 为起始地址的 UART ）进行等值映射 ( 可以映射连续 1MB 大小 )，无偏移，3 为映射的读写权限
-  create_mapping((uint64_t*)root_page_table, 0x10000000, 0x10000000, 1 * 1024 * 1024, PTE_V | PTE_R | PTE_W | PTE_X);
-  create_mapping((uint64_t*)root_page_table, 0x0c000000L, 0x0c000000L, 20 * 1024 * 1024, PTE_V | PTE_R | PTE_W | PTE_X);
+  // the first program comes from the initramfs, __init_sepc jumps to s1
+  struct elf_image img;
+  if (elf_open(&img, "init") != 0 ||
+      elf_map(&img, &task[0]->mm, (uint64_t*)root_page_table) != 0) {
+    printf("cannot load init\n");
+    while (1);
+  }
+  elf_close(&img);
+  task[0]->thread.s1 = img.ehdr.e_entry;
 
   printf("[PID = %d] Process Create Successfully!\n", task[0]->pid);
 }
\ No newline at end of file
@@ -10,9 +10,10 @@
 void m_ext_handler() {
   int irq = plic_claim();
   // virtio disk
-  if (irq == 1) {
+  if (irq == VIRTIO0_IRQ) {
     virtio_disk_intr();
   }
+  if (irq) plic_complete(irq);
 }
 
 void handler_s(uint64_t cause, uint64_t epc, uint64_t sp) {
@@ -38,8 +39,8 @@ void handler_s(uint64_t cause, uint64_t epc, uint64_t sp) {
       // 2. check whether the faulting address is in the range of a vm area
       // 3. check the permission of the vm area. The vma must be PTE_X/R/W
       // according to the faulting cause, and also be PTE_V, PTE_U
-      // 4. if the faulting address is valid, allocate physical pages, map it to
-      // the vm area, mark the vma mapped(vma->mapped = 1), and return
+      // 4. if the faulting address is valid, map the page holding it (a new
+      // zeroed page, or the file's page for a file mapping) and return
       // 5. otherwise, print error message and add 4 to the sepc (DONE)
 
       uint64_t *sp_ptr = (uint64_t *)(sp);
@@ -53,17 +54,12 @@ void handler_s(uint64_t cause, uint64_t epc, uint64_t sp) {
                ((vma->vm_flags & PTE_R) && (vma->vm_flags & PTE_W) &&
                 cause == 0xf))) {
 
-            uint64_t pa =
-                alloc_pages((vma->vm_end - vma->vm_start) / PAGE_SIZE);
-            if (pa == 0) {
-              printf("alloc_pages failed!\n");
+            // map the faulting page only
+            if (vma_fault(vma, (uint64_t*)((current->satp & ((1ULL << 44) - 1)) << 12),
+                          stval, cause == 0xf) != 0) {
+              printf("Page fault failed! addr = 0x%016lx\n", stval);
               sp_ptr[16] += 4;
-              return;
             }
-            create_mapping((current->satp & ((1ULL << 44) - 1)) << 12,
-                           vma->vm_start, pa, (vma->vm_end - vma->vm_start),
-                           vma->vm_flags);
-            vma->mapped = 1;
             return;
           } else {
             printf("Invalid permission! scause: %llx flags: %llx \n", cause,
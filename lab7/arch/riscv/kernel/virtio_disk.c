@@ -7,6 +7,7 @@
 // virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
 
+#include "mm.h"
 #include "sched.h"
 #include "virtio.h"
 #include "vm.h"
@@ -18,8 +19,9 @@ static struct disk {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
   // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*4096];
+  // contiguous pages of page-aligned physical memory, VIRTQ_SIZE bytes
+  // for NUM descriptors.
+  char pages[VIRTQ_SIZE];
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -62,7 +64,25 @@ static struct disk {
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
-  
+
+  // VIRTIO_RING_F_INDIRECT_DESC: each request uses a single ring
+  // descriptor pointing at its own table of header, data and status
+  // descriptors, indexed like ops[].
+  struct virtq_desc indirect[NUM][BUF_MAX_SEG + 2];
+
+  int has_indirect;   // negotiated VIRTIO_RING_F_INDIRECT_DESC
+  int has_event_idx;  // negotiated VIRTIO_RING_F_EVENT_IDX
+
+  // batching: while plugged, submissions are published to the avail
+  // ring but the device is only notified by virtio_disk_unplug().
+  int plugged;
+  uint16_t kicked_idx;  // avail->idx at the last notify
+
+  // requests in flight = submitted - completed. each counter has a
+  // single writer (S mode / M mode), so no lock is needed.
+  uint32_t submitted;
+  uint32_t completed;
+
 } __attribute__ ((aligned (4096))) disk;
 
 
@@ -96,9 +116,10 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // keep INDIRECT_DESC and EVENT_IDX when the device offers them.
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.has_indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.has_event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -115,24 +136,31 @@ virtio_disk_init(void)
   uint32_t max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  if(max < NUM){
+    printf("virtio disk: NUM %d > QUEUE_NUM_MAX %d\n", NUM, max);
     panic("virtio disk max queue too short");
+  }
+  if(!disk.has_indirect && BUF_MAX_SEG + 2 > NUM)
+    panic("virtio disk: NUM too small for BUF_MAX_SEG without indirect descriptors");
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
   memset(disk.pages, 0, sizeof(disk.pages));
   *R(VIRTIO_MMIO_QUEUE_PFN) = (PHYSICAL_ADDR(disk.pages)) >> 12;
 
   // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  // avail = pages + VIRTQ_AVAIL_OFF -- 2 * uint16, then num * uint16, then used_event
+  // used = pages + VIRTQ_USED_OFF -- 2 * uint16, then num * vRingUsedElem, then avail_event
 
   disk.desc = (struct virtq_desc *) PHYSICAL_ADDR(disk.pages);
-  disk.avail = (struct virtq_avail *)(PHYSICAL_ADDR(disk.pages) + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (PHYSICAL_ADDR(disk.pages) + 4096);
+  disk.avail = (struct virtq_avail *)(PHYSICAL_ADDR(disk.pages) + VIRTQ_AVAIL_OFF);
+  disk.used = (struct virtq_used *) (PHYSICAL_ADDR(disk.pages) + VIRTQ_USED_OFF);
 
   // all NUM descriptors start out unused.
   for(int i = 0; i < NUM; i++)
     disk.free[i] = 1;
 
+  printf("virtio disk: %d descriptors, indirect %d, event_idx %d\n",
+         NUM, disk.has_indirect, disk.has_event_idx);
+
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
@@ -179,12 +207,13 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a disk transfer uses one for the header, one per data
+// segment and one for the status.
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -195,58 +224,164 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// ask for an interrupt at the next completion, not at every one that
+// lands while the interrupt is being handled: virtio_disk_intr() drains
+// them all and re-arms for the next. only meaningful with EVENT_IDX.
+// called from S mode too, where virtio_disk_intr() may run in between:
+// retry until used_idx held still, or the value written would be stale
+// and the interrupt it asks for might never come.
+static void
+set_used_event(void)
+{
+  volatile uint16_t *used_idx = &disk.used_idx;
+  uint16_t seen;
+
+  if(!disk.has_event_idx)
+    return;
+  do {
+    seen = *used_idx;
+    uint32_t inflight = disk.submitted - *(volatile uint32_t *)&disk.completed;
+    if(inflight == 0)
+      return;
+    // a later used_event would leave the waiter of the first request
+    // asleep until the whole batch is done
+    disk.avail->used_event = seen;
+    __sync_synchronize();
+  } while(seen != *used_idx);
+}
+
+// notify the device about everything published since the last kick,
+// unless EVENT_IDX says it is still busy with the ring and will see it.
+static void
+kick(void)
+{
+  uint16_t new_idx = disk.avail->idx;
+  uint16_t old_idx = disk.kicked_idx;
+  if(new_idx == old_idx)
+    return;
+  disk.kicked_idx = new_idx;
+
+  set_used_event();
+
+  // the avail->idx store must be visible before we read avail_event.
+  __sync_synchronize();
+
+  if(!disk.has_event_idx ||
+     vring_need_event(disk.used->avail_event, new_idx, old_idx))
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// submissions between plug and unplug are handed to the device with a
+// single notify and complete with a single interrupt.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_plug(void)
 {
-  uint64_t sector = b->blockno * (4096 / 512);
+  disk.plugged = 1;
+}
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+void
+virtio_disk_unplug(void)
+{
+  disk.plugged = 0;
+  kick();
+}
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-  }
+// fill the descriptors of one request, header first and status last,
+// in table d. the i-th descriptor links to i+1 through link[i]; for an
+// indirect table link[] is just 0..n-1.
+static void
+fill_descs(struct virtq_desc *d, int *link, struct buf *b, int write, int slot)
+{
+  int nseg = b->nseg > 0 ? b->nseg : 1;
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = (struct virtio_blk_req *)PHYSICAL_ADDR(&disk.ops[idx[0]]);
+  struct virtio_blk_req *buf0 = (struct virtio_blk_req *)PHYSICAL_ADDR(&disk.ops[slot]);
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
     buf0->type = VIRTIO_BLK_T_IN; // read the disk
   buf0->reserved = 0;
-  buf0->sector = sector;
+  buf0->sector = b->blockno * (4096 / 512);
+
+  d[link[0]].addr = PHYSICAL_ADDR(buf0);
+  d[link[0]].len = sizeof(struct virtio_blk_req);
+  d[link[0]].flags = VRING_DESC_F_NEXT;
+  d[link[0]].next = link[1];
+
+  for(int i = 0; i < nseg; i++){
+    struct virtq_desc *e = &d[link[i + 1]];
+    if(b->nseg > 0){
+      e->addr = PHYSICAL_ADDR(b->seg[i].addr);
+      e->len = b->seg[i].len;
+    } else {
+      e->addr = PHYSICAL_ADDR(b->data);
+      e->len = 4096;
+    }
+    if(write)
+      e->flags = 0; // device reads the data
+    else
+      e->flags = VRING_DESC_F_WRITE; // device writes the data
+    e->flags |= VRING_DESC_F_NEXT;
+    e->next = link[i + 2];
+  }
 
-  disk.desc[idx[0]].addr = PHYSICAL_ADDR(buf0);
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  struct virtq_desc *st = &d[link[nseg + 1]];
+  disk.info[slot].status = 0xff; // device writes 0 on success
+  st->addr = PHYSICAL_ADDR(&disk.info[slot].status);
+  st->len = 1;
+  st->flags = VRING_DESC_F_WRITE; // device writes the status
+  st->next = 0;
+}
 
-  disk.desc[idx[1]].addr = PHYSICAL_ADDR(b->data);
-  disk.desc[idx[1]].len = 4096;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+// queue a request without waiting for it. b and the data it points to
+// must be physical addresses, since virtio_disk_intr() runs in M mode
+// with paging off. a request with b->nseg > 0 transfers the segments
+// to/from consecutive blocks starting at b->blockno in one request.
+// sleeps (yields the cpu) while the ring has no free descriptors.
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  int nseg = b->nseg > 0 ? b->nseg : 1;
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = PHYSICAL_ADDR(&disk.info[idx[0]].status);
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  if(nseg > BUF_MAX_SEG)
+    panic("virtio_disk_submit nseg");
+
+  // the spec's Section 5.2 says that legacy block operations use
+  // a descriptor for type/reserved/sector, the data descriptors,
+  // and one for a 1-byte status result. with indirect descriptors
+  // they live in a per-slot table and the ring holds one descriptor.
+  int ndesc = disk.has_indirect ? 1 : nseg + 2;
+
+  // descriptors are released by virtio_disk_intr(), let other tasks run meanwhile.
+  // a plugged batch must reach the device first or nothing ever completes.
+  int idx[BUF_MAX_SEG + 2];
+  while(alloc_descs(idx, ndesc) != 0){
+    kick();
+    schedule(0);
+  }
+
+  if(disk.has_indirect){
+    int link[BUF_MAX_SEG + 2];
+    for(int i = 0; i < nseg + 2; i++)
+      link[i] = i;
+    struct virtq_desc *tbl = (struct virtq_desc *)PHYSICAL_ADDR(disk.indirect[idx[0]]);
+    fill_descs(tbl, link, b, write, idx[0]);
+    disk.desc[idx[0]].addr = PHYSICAL_ADDR(tbl);
+    disk.desc[idx[0]].len = (nseg + 2) * sizeof(struct virtq_desc);
+    disk.desc[idx[0]].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[idx[0]].next = 0;
+  } else {
+    fill_descs(disk.desc, idx, b, write, idx[0]);
+  }
 
   // record struct buf for virtio_disk_intr().
   b->disk = 1;
+  b->waiter = 0;
   disk.info[idx[0]].b = (struct buf *)PHYSICAL_ADDR(b);
+  disk.submitted += 1;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -258,25 +393,42 @@ virtio_disk_rw(struct buf *b, int write)
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  if(!disk.plugged)
+    kick();
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
+// sleep until virtio_disk_intr() says the request has finished.
+// returns the device status, 0 on success.
+int
+virtio_disk_wait(struct buf *b)
+{
+  volatile struct buf *vb = b;
+  // b may still sit in a plugged batch the device hasn't been told about.
+  if(vb->disk)
+    kick();
+  while(vb->disk){
+    // publish ourselves before re-checking, so a completion that
+    // lands in between still finds us and clears blocked.
+    vb->waiter = (struct task_struct *)PHYSICAL_ADDR(current);
+    current->blocked = 1;
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0) {
-      continue;
+    if(vb->disk == 0){
+      current->blocked = 0;
+      break;
     }
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-
-    disk.used_idx += 1;
+    // nothing else runnable: schedule() returns and we poll again.
+    schedule(0);
   }
+  current->blocked = 0;
+  return vb->status;
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  if(virtio_disk_wait(b) != 0)
+    panic("virtio_disk_rw status");
 }
 
 void
@@ -295,17 +447,39 @@ virtio_disk_intr()
   // the device increments disk.used->idx when it
   // adds an entry to the used ring.
 
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+  // runs in M mode: every pointer followed here is a physical address.
+  while(1){
+    while(disk.used_idx != disk.used->idx){
+      __sync_synchronize();
+      int id = disk.used->ring[disk.used_idx % NUM].id;
+
+      struct buf *b = disk.info[id].b;
+      b->status = disk.info[id].status;
+      disk.info[id].b = 0;
+      free_chain(id);
+
+      __sync_synchronize();
+      b->disk = 0;   // disk is done with buf
+
+      // wake up the task sleeping in virtio_disk_wait()
+      if(b->waiter){
+        b->waiter->blocked = 0;
+        need_resched = 1;
+      }
+
+      disk.used_idx += 1;
+      disk.completed += 1;
+    }
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
+    if(!disk.has_event_idx)
+      break;
 
-    disk.used_idx += 1;
+    // one interrupt for the next completion. the device may have
+    // moved past the new used_event already, so look again.
+    set_used_event();
+    __sync_synchronize();
+    if(disk.used_idx == disk.used->idx)
+      break;
   }
 }
 
@@ -333,4 +507,10 @@ int plic_claim(void) {
   int hart = 0;
   int irq = *(uint32_t *)PLIC_SCLAIM(hart);
   return irq;
+}
+
+// tell the PLIC we've served this irq, otherwise it is never raised again.
+void plic_complete(int irq) {
+  int hart = 0;
+  *(uint32_t *)PLIC_SCLAIM(hart) = irq;
 }
\ No newline at end of file
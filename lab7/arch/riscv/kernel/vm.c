@@ -2,12 +2,56 @@
 #include "mm.h"
 #include "sched.h"
 #include "stdio.h"
+#include "fs.h"
+#include "riscv.h"
 
 extern uint64_t text_start;
 extern uint64_t rodata_start;
 extern uint64_t data_start;
 extern uint64_t _end;
-extern uint64_t user_program_start;
+
+// paging_init 建立的内核页表，进程页表通过 map_kernel 共享其中的子树
+uint64_t *kernel_pgtbl;
+
+// R/W/X 任一位为 1 的是叶子，否则指向下一级页表
+#define PTE_LEAF(pte) ((pte) & (PTE_R | PTE_W | PTE_X))
+#define PTE_ADDR(pte) (((pte) >> 10) << 12)
+
+// 第 level 级叶子映射的大小：0 为 4KB，1 为 2MB，2 为 1GB
+static uint64_t level_size(int level) {
+  return (uint64_t)PAGE_SIZE << (9 * level);
+}
+
+// 页表占用的页数，进程全部退出后应回到只剩 kernel_pgtbl 下级页表的数量
+static uint64_t pgtbl_pages;
+
+static uint64_t *pgtbl_page() {
+  uint64_t *table = (uint64_t *)alloc_page();
+  if (table) pgtbl_pages++;
+  return table;
+}
+
+static void pgtbl_free_page(uint64_t *table) {
+  free_pages((uint64_t)table);
+  pgtbl_pages--;
+}
+
+// 返回 *pte 指向的下一级页表，不存在时分配；大页叶子拆成 512 个下一级的叶子
+static uint64_t *next_table(uint64_t *pte, int level, int perm) {
+  if ((*pte & PTE_V) == 0) {
+    uint64_t *next = pgtbl_page();
+    *pte = (((uint64_t)next >> 12) << 10) |
+           (level == 1 ? (perm & PTE_U) | PTE_V : PTE_V);
+  } else if (PTE_LEAF(*pte)) {
+    uint64_t *next = pgtbl_page();
+    uint64_t child = level_size(level - 1);
+    for (int i = 0; i < 512; i++) {
+      next[i] = *pte + (((i * child) >> 12) << 10);
+    }
+    *pte = (((uint64_t)next >> 12) << 10) | PTE_V;
+  }
+  return (uint64_t *)PTE_ADDR(*pte);
+}
 
 void create_mapping(uint64_t *pgtbl, uint64_t va, uint64_t pa, uint64_t sz,
                     int perm) {
@@ -29,68 +73,79 @@ void create_mapping(uint64_t *pgtbl, uint64_t va, uint64_t pa, uint64_t sz,
   // 8. 设置三级页表项的内容
 
   // DONE: 请完成你的代码
-  int page_num = (sz - 1) / PAGE_SIZE + 1;
-
-  for (int i = 0; i < page_num; ++i) {
-
-    uint64_t va_i = va + i * PAGE_SIZE;
-    uint64_t pa_i = pa + i * PAGE_SIZE;
-
-    // 通过 va 得到一级页表项的索引
-    uint64_t first_index = (va_i >> 30) & 0x1ff;
-    // 通过 va 得到二级页表项的索引
-    uint64_t second_index = (va_i >> 21) & 0x1ff;
-    // 通过 va 得到三级页表项的索引
-    uint64_t third_index = (va_i >> 12) & 0x1ff;
-
-    // 如果一级页表项不存在，分配一个物理页面
-    if ((pgtbl[first_index] & PTE_V) == 0) {
-      // 分配一个物理页面
-      uint64_t *second_page = (uint64_t *)alloc_page();
-      // 设置一级页表项的内容
-      pgtbl[first_index] = (((uint64_t)second_page >> 12) << 10) |
-                           PTE_V /*| (perm & (PTE_U | PTE_V))*/;
-    }
-    // 通过一级页表项的内容得到二级页表的首地址
-    uint64_t *second_page = (uint64_t *)((pgtbl[first_index] >> 10) << 12);
-    // 如果二级页表项不存在，分配一个物理页面
-    if ((second_page[second_index] & PTE_V) == 0) {
-      // 分配一个物理页面
-      uint64_t *third_page = (uint64_t *)alloc_page();
-      // 设置二级页表项的内容
-      second_page[second_index] =
-          (((uint64_t)third_page >> 12) << 10) | (perm & (PTE_U | PTE_V));
+  // va、pa 都按 1GB / 2MB 对齐且剩余大小足够时直接写大页叶子，不再向下分配页表。
+  // 在大页中间映射 (比如修改 text/rodata/data 的权限) 时，先把大页拆成 512 个
+  // 下一级的叶子，所以只有边界所在的大页会被拆开。
+  uint64_t left = ((sz - 1) / PAGE_SIZE + 1) * PAGE_SIZE;
+
+  while (left > 0) {
+    uint64_t *table = pgtbl;
+    for (int level = 2;; level--) {
+      uint64_t size = level_size(level);
+      uint64_t *pte = &table[(va >> (12 + 9 * level)) & 0x1ff];
+      // 已经有下一级页表时不能用大页覆盖，否则其中的映射会丢失
+      int table_below = (*pte & PTE_V) && !PTE_LEAF(*pte);
+      if (level == 0 || (PTE_LEAF(perm) && !table_below && va % size == 0 &&
+                         pa % size == 0 && left >= size)) {
+        *pte = ((pa >> 12) << 10) | perm;
+        va += size;
+        pa += size;
+        left -= size;
+        break;
+      }
+      table = next_table(pte, level, perm);
     }
-    // 通过二级页表项的内容得到三级页表的首地址
-    uint64_t *third_page =
-        (uint64_t *)((second_page[second_index] >> 10) << 12);
-    // 设置三级页表项的内容
-    third_page[third_index] = ((pa_i >> 12) << 10) | perm;
   }
 }
 
 uint64_t get_pte(uint64_t *pgtbl, uint64_t va) {
-
-  // 通过 va 得到一级页表项的索引
-  uint64_t first_index = (va >> 30) & 0x1ff;
-  // 通过 va 得到二级页表项的索引
-  uint64_t second_index = (va >> 21) & 0x1ff;
-  // 通过 va 得到三级页表项的索引
-  uint64_t third_index = (va >> 12) & 0x1ff;
-
-  if ((pgtbl[first_index] & PTE_V) == 0) {
-    return 0;
+  // 返回 va 所在 4KB 页的页表项，大页叶子换算成该页对应的物理页号
+  uint64_t *table = pgtbl;
+  for (int level = 2; level > 0; level--) {
+    uint64_t pte = table[(va >> (12 + 9 * level)) & 0x1ff];
+    if ((pte & PTE_V) == 0) {
+      return 0;
+    }
+    if (PTE_LEAF(pte)) {
+      return pte + (((va & (level_size(level) - 1)) >> 12) << 10);
+    }
+    table = (uint64_t *)PTE_ADDR(pte);
   }
-  // 通过一级页表项的内容得到二级页表的首地址
-  uint64_t *second_page = (uint64_t *)((pgtbl[first_index] >> 10) << 12);
+  return table[(va >> 12) & 0x1ff];
+}
 
-  if ((second_page[second_index] & PTE_V) == 0) {
-    return 0;
+// 清除 table (第 level 级) 中 [va, end) 的映射，下级页表空了就释放，
+// 与内核共享的页表除外。返回 table 是否已经没有有效的页表项。
+static bool unmap_level(uint64_t *table, int level, uint64_t va, uint64_t end) {
+  uint64_t size = level_size(level);
+  while (va < end) {
+    uint64_t base = va & ~(size - 1);
+    uint64_t stop = base + size < end ? base + size : end;
+    uint64_t *pte = &table[(va >> (12 + 9 * level)) & 0x1ff];
+    if (*pte & PTE_V) {
+      if (PTE_LEAF(*pte) && va == base && stop == base + size) {
+        *pte = 0;
+      } else if (level > 0) {
+        uint64_t *next = next_table(pte, level, 0);
+        if (unmap_level(next, level - 1, va, stop) && !kernel_range(base, base + size)) {
+          pgtbl_free_page(next);
+          *pte = 0;
+        }
+      } else {
+        *pte = 0;
+      }
+    }
+    va = stop;
+  }
+  for (int i = 0; i < 512; i++) {
+    if (table[i] & PTE_V) return 0;
   }
-  // 通过二级页表项的内容得到三级页表的首地址
-  uint64_t *third_page = (uint64_t *)((second_page[second_index] >> 10) << 12);
+  return 1;
+}
 
-  return third_page[third_index];
+// 解除 [va, va + sz) 的映射，不会为此分配页表
+void unmap_range(uint64_t *pgtbl, uint64_t va, uint64_t sz) {
+  unmap_level(pgtbl, 2, va & ~(PAGE_SIZE - 1), va + sz);
 }
 
 void paging_init() {
@@ -111,42 +166,376 @@ void paging_init() {
   // paging_init 创建的页表。
 
   uint64_t *pgtbl = alloc_page();
+  kernel_pgtbl = pgtbl;
   // DONE: 请完成你的代码
   // 调用 create_mapping 函数将虚拟地址 0xffffffc000000000 开始的 16 MB
   // 空间映射到起始物理地址为 0x80000000 的 16MB 空间
   create_mapping(pgtbl, 0xffffffc000000000, 0x80000000, 16 * 1024 * 1024,
-                 PTE_V | PTE_R | PTE_W | PTE_X);
+                 PTE_V | PTE_G | PTE_R | PTE_W | PTE_X);
   // 修改对内核空间不同 section
   // 所在页属性的设置，完成对不同section的保护，其中text段的权限为 r-x, rodata
   // 段为 r--, 其他段为 rw-。
   create_mapping(pgtbl, 0xffffffc000000000, 0x80000000,
-                 (uint64_t)&rodata_start - 0x80000000, PTE_V | PTE_R | PTE_X);
+                 (uint64_t)&rodata_start - 0x80000000, PTE_V | PTE_G | PTE_R | PTE_X);
   create_mapping(
       pgtbl, (uint64_t)&rodata_start - 0x80000000 + 0xffffffc000000000,
       (uint64_t)&rodata_start, (uint64_t)&data_start - (uint64_t)&rodata_start,
-      PTE_V | PTE_R);
+      PTE_V | PTE_G | PTE_R);
   create_mapping(pgtbl, (uint64_t)&data_start - 0x80000000 + 0xffffffc000000000,
                  (uint64_t)&data_start, (uint64_t)&_end - (uint64_t)&data_start,
-                 PTE_V | PTE_R | PTE_W);
+                 PTE_V | PTE_G | PTE_R | PTE_W);
   // 对内核起始地址 0x80000000 的16MB空间做等值映射（将虚拟地址 0x80000000
   // 开始的 16 MB 空间映射到起始物理地址为 0x80000000 的 16MB 空间）
   create_mapping(pgtbl, 0x80000000, 0x80000000, 16 * 1024 * 1024,
-                 PTE_V | PTE_R | PTE_W | PTE_X);
+                 PTE_V | PTE_G | PTE_R | PTE_W | PTE_X);
   // 修改对内核空间不同 section
   // 所在页属性的设置，完成对不同section的保护，其中text段的权限为 r-x, rodata
   // 段为 r--, 其他段为 rw-。
   create_mapping(pgtbl, 0x80000000, 0x80000000,
-                 (uint64_t)&rodata_start - 0x80000000, PTE_V | PTE_R | PTE_X);
+                 (uint64_t)&rodata_start - 0x80000000, PTE_V | PTE_G | PTE_R | PTE_X);
   create_mapping(pgtbl, (uint64_t)&rodata_start, (uint64_t)&rodata_start,
                  (uint64_t)&data_start - (uint64_t)&rodata_start,
-                 PTE_V | PTE_R);
+                 PTE_V | PTE_G | PTE_R);
   create_mapping(pgtbl, (uint64_t)&data_start, (uint64_t)&data_start,
                  (uint64_t)&_end - (uint64_t)&data_start,
-                 PTE_V | PTE_R | PTE_W);
+                 PTE_V | PTE_G | PTE_R | PTE_W);
   // 将必要的硬件地址（如 0x10000000 为起始地址的 UART ）进行等值映射 (
   // 可以映射连续 1MB 大小 )，无偏移，3 为映射的读写权限
   create_mapping(pgtbl, 0x10000000, 0x10000000, 1 * 1024 * 1024,
-                 PTE_V | PTE_R | PTE_W | PTE_X);
+                 PTE_V | PTE_G | PTE_R | PTE_W | PTE_X);
   
-  create_mapping(pgtbl, 0x0c000000L, 0x0c000000L, 20 * 1024 * 1024, PTE_V | PTE_R | PTE_W | PTE_X);
+  create_mapping(pgtbl, 0x0c000000L, 0x0c000000L, 20 * 1024 * 1024, PTE_V | PTE_G | PTE_R | PTE_W | PTE_X);
+}
+
+// ---------------------------------------------------------------------
+// 进程页表不再逐页重建内核映射，而是直接引用 kernel_pgtbl 的页表：根页表
+// 中高地址 (0xffffffc000000000) 和等值映射 (0x80000000) 的表项指向同一份
+// 二级页表。UART 和 PLIC 与用户程序同在第 0 个 1GB 内，所以每个进程有自己
+// 的第 0 号二级页表，从内核复制 UART 的三级页表指针和 PLIC 的 2MB 大页。
+// 共享的页表在进程退出时不能释放，用户映射也不能落在这些表覆盖的范围内。
+
+#define SUPERPAGE_SIZE (1UL << 21)
+
+static void map_kernel(uint64_t *pgtbl) {
+  for (int i = 1; i < 512; i++) pgtbl[i] = kernel_pgtbl[i];
+  pgtbl[0] = 0;
+  if ((kernel_pgtbl[0] & PTE_V) == 0) return;
+  uint64_t *kernel_second = (uint64_t *)PTE_ADDR(kernel_pgtbl[0]);
+  uint64_t *second = pgtbl_page();
+  for (int i = 0; i < 512; i++) second[i] = kernel_second[i];
+  pgtbl[0] = (((uint64_t)second >> 12) << 10) | PTE_V;
+}
+
+// a new root page table of a process, with the kernel linked in
+uint64_t *pgtbl_alloc() {
+  uint64_t *pgtbl = pgtbl_page();
+  map_kernel(pgtbl);
+  return pgtbl;
+}
+
+// kernel is the kernel's table at the same place as table, or NULL.
+// the entries equal to the kernel's point to shared tables.
+static void free_table(uint64_t *table, uint64_t *kernel, int level) {
+  for (int i = 0; level > 0 && i < 512; i++) {
+    uint64_t pte = table[i];
+    if ((pte & PTE_V) == 0 || PTE_LEAF(pte)) continue;
+    if (kernel && kernel[i] == pte) continue;
+    uint64_t *kernel_next = NULL;
+    if (kernel && (kernel[i] & PTE_V) && !PTE_LEAF(kernel[i])) {
+      kernel_next = (uint64_t *)PTE_ADDR(kernel[i]);
+    }
+    free_table((uint64_t *)PTE_ADDR(pte), kernel_next, level - 1);
+  }
+  pgtbl_free_page(table);
+}
+
+// free a process page table and all its own lower level tables, the
+// mappings of user pages must be gone already
+void pgtbl_free(uint64_t *pgtbl) {
+  free_table(pgtbl, kernel_pgtbl, 2);
+}
+
+void pgtbl_stat() {
+  printf("[vm] page-table pages %d\n", (int)pgtbl_pages);
+}
+
+// returns true if [start, end) touches a page table shared with the kernel
+bool kernel_range(uint64_t start, uint64_t end) {
+  if (end <= start || end > (1UL << 38)) return 1;
+  for (uint64_t va = start & ~(SUPERPAGE_SIZE - 1); va < end; va += SUPERPAGE_SIZE) {
+    uint64_t first = kernel_pgtbl[(va >> 30) & 0x1ff];
+    if ((first & PTE_V) == 0) continue;
+    if ((va >> 30) != 0) return 1;
+    uint64_t *second = (uint64_t *)((first >> 10) << 12);
+    if (second[(va >> 21) & 0x1ff] & PTE_V) return 1;
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// ASID 分配：每个地址空间在当前代 (generation) 中拿到一个没用过的 ASID，
+// 切换进程时不需要刷新 TLB，解除映射也只刷新本地址空间的表项。ASID 用完后
+// 进入下一代并刷新整个 TLB，其它进程下次被调度时重新分配。ASID 0 留给
+// kernel_pgtbl；内核映射带 PTE_G，所有地址空间共用同一份 TLB 表项。
+// 硬件不支持 ASID 时 (asid_max 为 0)，__switch_to 在写 satp 后刷新 TLB。
+
+static uint64_t asid_max;
+static uint64_t asid_generation = 1UL << ASID_GEN_SHIFT;
+static uint64_t asid_next = 1;
+uint64_t tlb_flush_on_switch;
+
+#define ASID_MASK ((1UL << ASID_GEN_SHIFT) - 1)
+// 解除映射的页数超过这个值时直接刷新整个地址空间
+#define FLUSH_TLB_PAGES 16
+
+void asid_init() {
+  // 写入全 1，读回的是硬件实现的 ASID 位
+  uint64_t satp = read_csr(satp);
+  write_csr(satp, satp | SATP_ASID_MASK);
+  asid_max = (read_csr(satp) & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+  write_csr(satp, satp);
+  asm volatile("sfence.vma");
+  tlb_flush_on_switch = asid_max == 0;
+}
+
+uint64_t asid_satp(uint64_t *pgtbl, uint64_t asid) {
+  return (uint64_t)pgtbl >> 12 | SATP_SV39 |
+         ((asid & ASID_MASK) << SATP_ASID_SHIFT);
+}
+
+static void asid_rollover() {
+  asid_generation += 1UL << ASID_GEN_SHIFT;
+  asid_next = 1;
+  // current keeps running on its old ASID, give it the first one of the new
+  // generation so that the ASID is not handed out twice
+  if (current && (current->mm.asid & ASID_MASK)) {
+    current->mm.asid = asid_generation | asid_next++;
+    uint64_t satp = read_csr(satp) & ~SATP_ASID_MASK;
+    write_csr(satp, satp | ((current->mm.asid & ASID_MASK) << SATP_ASID_SHIFT));
+  }
+  asm volatile("sfence.vma");
+}
+
+// a new ASID of the current generation, for mm.asid
+uint64_t asid_alloc() {
+  if (asid_max == 0) return asid_generation;
+  if (asid_next > asid_max) asid_rollover();
+  return asid_generation | asid_next++;
+}
+
+// called before switching to next: an ASID of an older generation may
+// belong to another address space by now
+void asid_switch(struct task_struct *next) {
+  if (asid_max == 0 || (next->mm.asid & ~ASID_MASK) == asid_generation) return;
+  next->mm.asid = asid_alloc();
+  next->satp = (next->satp & ~SATP_ASID_MASK) |
+               ((next->mm.asid & ASID_MASK) << SATP_ASID_SHIFT);
+}
+
+// the flushes below only touch the current address space
+void flush_tlb_page(uint64_t va) {
+  asm volatile("sfence.vma %0, %1" : : "r"(va), "r"(current->mm.asid & ASID_MASK));
+}
+
+void flush_tlb_mm() {
+  asm volatile("sfence.vma zero, %0" : : "r"(current->mm.asid & ASID_MASK));
+}
+
+void flush_tlb_range(uint64_t start, uint64_t end) {
+  if (end - start > FLUSH_TLB_PAGES * PAGE_SIZE) {
+    flush_tlb_mm();
+    return;
+  }
+  for (uint64_t va = start & ~(PAGE_SIZE - 1); va < end; va += PAGE_SIZE) {
+    flush_tlb_page(va);
+  }
+}
+
+// ---------------------------------------------------------------------
+// 虚拟内存区域按页建立映射：缺页时只映射出错的那一页，匿名内存用 vm_pages
+// 位图记录哪些页已经映射，vm_rss 为已映射的页数。文件映射读缺页时顺带映射
+// 同一组 FAULT_AROUND_PAGES 个页中已在文件范围内的页。
+// fork 时匿名页 (包括用户栈) 和私有文件映射的页写时复制：父子进程共享只读的物理页，struct page
+// 中的 refcount 记录共享者数量，写缺页时才复制，最后一个共享者直接恢复写权限。
+// vm_image 区域是内置程序的只读段，直接映射内核镜像中的页，不释放也不复制。
+
+uint64_t vma_nr_pages(struct vm_area_struct *vma) {
+  return (vma->vm_end - vma->vm_start + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+// set up the per-page state of a new area, returns 0 on success
+int vma_init(struct vm_area_struct *vma) {
+  vma->vm_rss = 0;
+  vma->vm_pages = NULL;
+  if (vma->vm_ino || vma->vm_image) return 0;
+  uint64_t bytes = (vma_nr_pages(vma) + 7) / 8;
+  vma->vm_pages = (uint8_t *)kmalloc(bytes);
+  if (vma->vm_pages == NULL) return -1;
+  memset(vma->vm_pages, 0, bytes);
+  return 0;
+}
+
+bool vma_present(struct vm_area_struct *vma, uint64_t va) {
+  uint64_t i = (va - vma->vm_start) / PAGE_SIZE;
+  return (vma->vm_pages[i / 8] >> (i % 8)) & 1;
+}
+
+static void vma_set_present(struct vm_area_struct *vma, uint64_t va) {
+  uint64_t i = (va - vma->vm_start) / PAGE_SIZE;
+  vma->vm_pages[i / 8] |= 1 << (i % 8);
+  vma->vm_rss++;
+}
+
+// map one page of a file area, returns 0 on success
+static int vma_file_page(struct vm_area_struct *vma, uint64_t *pgtbl,
+                         uint64_t va, bool write) {
+  int perm;
+  uint64_t pa = sfs_fault(vma, va, write, &perm);
+  if (pa == 0) return -1;
+  if (!(get_pte(pgtbl, va) & PTE_V)) vma->vm_rss++;
+  create_mapping(pgtbl, va, pa, PAGE_SIZE, perm);
+  // the page may have been mapped read-only before
+  flush_tlb_page(va);
+  return 0;
+}
+
+// a write to a present anonymous page that may be shared copy-on-write
+static int vma_cow(struct vm_area_struct *vma, uint64_t *pgtbl, uint64_t va) {
+  uint64_t pte = get_pte(pgtbl, va);
+  uint64_t pa = (pte >> 10) << 12;
+  if (pte & PTE_W) return 0;
+  if (page_ref(pa) > 1) {
+    uint64_t copy = alloc_pages_flags(1, ALLOC_NOZERO);
+    if (copy == 0) return -1;
+    memcpy((void *)copy, (void *)pa, PAGE_SIZE);
+    page_ref_dec(pa);
+    pa = copy;
+  }
+  create_mapping(pgtbl, va, pa, PAGE_SIZE, vma->vm_flags);
+  flush_tlb_page(va);
+  return 0;
+}
+
+// handle a fault at va inside vma whose permissions were checked already.
+// returns 0 on success, -1 when no page can back va.
+int vma_fault(struct vm_area_struct *vma, uint64_t *pgtbl, uint64_t va,
+              bool write) {
+  va &= ~(PAGE_SIZE - 1);
+  if (vma->vm_image) {
+    // read-only pages of a program in the kernel image, shared by everyone
+    if (!(get_pte(pgtbl, va) & PTE_V)) vma->vm_rss++;
+    create_mapping(pgtbl, va, vma->vm_image + (va - vma->vm_start), PAGE_SIZE,
+                   vma->vm_flags & ~PTE_W);
+    return 0;
+  }
+  // a private file page may be shared with a forked task
+  if (vma->vm_ino && !vma->vm_shared && (get_pte(pgtbl, va) & PTE_V))
+    return write ? vma_cow(vma, pgtbl, va) : 0;
+  if (vma->vm_ino) {
+    // the kernel may be prefaulting user memory from inside sfs_*
+    bool nested = sfs_lock_held();
+    if (!nested) sfs_lock();
+    int ret = vma_file_page(vma, pgtbl, va, write);
+    if (ret == 0 && !write) {
+      uint64_t start = va & ~(FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+      for (uint64_t a = start; a < start + FAULT_AROUND_PAGES * PAGE_SIZE; a += PAGE_SIZE) {
+        if (a == va || a < vma->vm_start || a >= vma->vm_end) continue;
+        if (get_pte(pgtbl, a) & PTE_V) continue;
+        if (vma_file_page(vma, pgtbl, a, 0) != 0) break;
+      }
+    }
+    if (!nested) sfs_unlock();
+    return ret;
+  }
+  if (vma_present(vma, va)) return write ? vma_cow(vma, pgtbl, va) : 0;
+  uint64_t pa = alloc_page();
+  if (pa == 0) return -1;
+  create_mapping(pgtbl, va, pa, PAGE_SIZE, vma->vm_flags);
+  vma_set_present(vma, va);
+  return 0;
+}
+
+// set up dst, a copy of src for a forked task. anonymous pages and the
+// pages of private file mappings are shared copy-on-write: both sides map
+// them read-only until one writes. shared file pages are faulted in again
+// by the child. returns 0 on success.
+int vma_copy(struct vm_area_struct *dst, struct vm_area_struct *src,
+             uint64_t *dst_pgtbl, uint64_t *src_pgtbl) {
+  if (vma_init(dst) != 0) return -1;
+  if (src->vm_image) return 0;
+  if (src->vm_ino) {
+    reclaim_block(src->vm_ino);
+    if (src->vm_shared) return 0;
+  }
+  int perm = src->vm_flags & ~PTE_W;
+  for (uint64_t va = src->vm_start; va < src->vm_end; va += PAGE_SIZE) {
+    uint64_t pte = get_pte(src_pgtbl, va);
+    // private file pages have no vm_pages bitmap, their pte tells
+    if (src->vm_ino ? !(pte & PTE_V) : !vma_present(src, va)) continue;
+    uint64_t pa = (pte >> 10) << 12;
+    page_ref_inc(pa);
+    if (src->vm_flags & PTE_W) create_mapping(src_pgtbl, va, pa, PAGE_SIZE, perm);
+    create_mapping(dst_pgtbl, va, pa, PAGE_SIZE, perm);
+    if (src->vm_ino) dst->vm_rss++;
+    else vma_set_present(dst, va);
+  }
+  // the parent's writable translations are stale now
+  if (src->vm_rss > 0 && (src->vm_flags & PTE_W)) flush_tlb_mm();
+  return 0;
+}
+
+// free the pages of vma and clear its mappings
+void vma_unmap(struct vm_area_struct *vma, uint64_t *pgtbl) {
+  if (vma->vm_ino) {
+    sfs_lock();
+    sfs_munmap(vma, pgtbl);
+    sfs_unlock();
+  } else if (!vma->vm_image) {
+    for (uint64_t va = vma->vm_start; va < vma->vm_end; va += PAGE_SIZE) {
+      if (!vma_present(vma, va)) continue;
+      uint64_t pa = (get_pte(pgtbl, va) >> 10) << 12;
+      if (page_ref_dec(pa)) free_pages(pa);
+    }
+    kfree(vma->vm_pages);
+    vma->vm_pages = NULL;
+  }
+  vma->vm_rss = 0;
+  unmap_range(pgtbl, vma->vm_start, vma->vm_end - vma->vm_start);
+}
+
+// add an anonymous area to mm, returns NULL on failure
+struct vm_area_struct *vma_add(struct mm_struct *mm, uint64_t start, uint64_t len,
+                               uint64_t flags) {
+  struct vm_area_struct *vma = kmalloc(sizeof(struct vm_area_struct));
+  if (vma == NULL) return NULL;
+  vma->vm_start = start;
+  vma->vm_end = start + len;
+  vma->vm_flags = flags;
+  vma->vm_ino = 0;
+  vma->vm_offset = 0;
+  vma->vm_shared = 0;
+  vma->vm_image = 0;
+  if (vma_init(vma) != 0) {
+    kfree(vma);
+    return NULL;
+  }
+  list_add(&vma->vm_list, &mm->vm->vm_list);
+  return vma;
+}
+
+// make [va, va + len) of the current task safe for the kernel to touch.
+// trap_s assumes the trap came from user mode, so the kernel must not
+// fault on user memory itself: missing pages are mapped, file pages
+// through sfs_fault, and for a write, shared pages are copied first.
+// callable with or without the sfs lock held.
+void vma_prefault(uint64_t va, uint64_t len, bool write) {
+  uint64_t *pgtbl = (uint64_t *)((current->satp & ((1ULL << 44) - 1)) << 12);
+  for (uint64_t a = va & ~(PAGE_SIZE - 1); a < va + len; a += PAGE_SIZE) {
+    struct vm_area_struct *vma;
+    list_for_each_entry(vma, &current->mm.vm->vm_list, vm_list) {
+      if (a < vma->vm_start || a >= vma->vm_end) continue;
+      if (!write || (vma->vm_flags & PTE_W)) vma_fault(vma, pgtbl, a, write);
+      break;
+    }
+  }
 }
@@ -8,6 +8,7 @@
 
 #define SFS_FLAG_READ (0x1)
 #define SFS_FLAG_WRITE (0x2)
+#define SFS_FLAG_DIRECT (0x4)
 
 int sfs_open(const char *path, uint32_t flags);
 
@@ -0,0 +1,4 @@
+#pragma once
+
+// 内核把缓存、内存分配等统计信息打印到控制台
+void kstat();
@@ -8,6 +8,10 @@
 #define PTE_X 0x008 // Execute
 #define PTE_U 0x010 // User
 
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_ANONYMOUS 0x20
+
 void *mmap(void *__addr, size_t __len, int __prot, int __flags, int __fd,
            __off_t __offset);
 
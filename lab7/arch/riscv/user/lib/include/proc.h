@@ -5,4 +5,4 @@
 int fork();
 void wait(int pid);
 void exit(int ret);
-void exec(const char * path);
\ No newline at end of file
+int exec(const char * path);
\ No newline at end of file
@@ -17,6 +17,8 @@
 #define SFS_WRITE     1005
 #define SFS_GET_FILES 1006
 
+#define SYS_KSTAT 1100 // 打印内核的统计信息
+
 #include "types.h"
 
 struct ret_info {
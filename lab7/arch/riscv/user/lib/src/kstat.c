@@ -0,0 +1,6 @@
+#include "kstat.h"
+#include "syscall.h"
+
+void kstat() {
+  u_syscall(SYS_KSTAT, 0, 0, 0, 0, 0, 0);
+}
@@ -14,6 +14,8 @@ void exit(int ret) {
   u_syscall(SYS_EXIT, ret, 0, 0, 0, 0, 0);
 }
 
-void exec(const char * path) {
-  u_syscall(SYS_EXEC, (uint64_t)path, 0, 0, 0, 0, 0);
+// returns only if the program cannot be loaded, with -1
+int exec(const char * path) {
+  struct ret_info ret = u_syscall(SYS_EXEC, (uint64_t)path, 0, 0, 0, 0, 0);
+  return ret.a0;
 }
\ No newline at end of file
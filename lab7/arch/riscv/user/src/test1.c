@@ -2,6 +2,7 @@
 #include "stdio.h"
 #include "getpid.h"
 #include "getchar.h"
+#include "kstat.h"
 
 int strcmp(const char *a, const char *b);
 int getchar_until_valid();
@@ -43,6 +44,8 @@ input_end:
         printf("%s ", program[i]);
       }
       printf("\n");
+    } else if (strcmp(input, "stat") == 0) {
+      kstat();
     } else {
       for (int i = 0; i < 4; i++) {
         if (strcmp(input, program[i]) == 0) {
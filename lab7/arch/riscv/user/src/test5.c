@@ -1,5 +1,6 @@
 #include "fs.h"
 #include "getchar.h"
+#include "kstat.h"
 #include "mm.h"
 #include "proc.h"
 #include "stdio.h"
@@ -38,6 +39,7 @@ int main() {
   printf("> pwd\n");
   printf("> echo filename content\n");
   printf("> echo dir/filename content\n");
+  printf("> stat\n");
 
   for (;;) {
     n = 0;
@@ -84,6 +86,10 @@ int main() {
       path_add_entry(path, input + 3);
     }
 
+    if (strcmp(input, "stat") == 0) {
+      kstat();
+    }
+
     if (strcmp(input, "exit") == 0) {
       exit(0);
     }
@@ -3,8 +3,25 @@
 #include "defs.h"
 #include "stdio.h"
 
+// max data segments in one request.
+// with indirect descriptors a request takes one ring slot whatever its
+// size; otherwise the chain needs nseg + 2 descriptors, so keep it below NUM.
+#define BUF_MAX_SEG 16
+
+struct task_struct;
+
+// one physically contiguous piece of a vectored request
+struct buf_seg {
+  uint8_t *addr;  // physical address
+  uint32_t len;   // multiple of 512
+};
+
 struct buf {
-  int disk;
-  uint32_t blockno;
-  uint8_t *data; // at least 4096 byte
-};
\ No newline at end of file
+  int disk;       // 1 while the request is owned by the device
+  int status;     // device status of the last request, 0 on success
+  uint32_t blockno; // first block, the segments cover consecutive blocks from here
+  uint8_t *data; // at least 4096 byte, used when nseg == 0
+  int nseg;       // number of segments in seg[], 0 for a single-block request
+  struct buf_seg seg[BUF_MAX_SEG];
+  struct task_struct *waiter; // task sleeping on this request (physical address)
+};
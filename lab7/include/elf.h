@@ -0,0 +1,78 @@
+#pragma once
+
+#include "defs.h"
+
+/* ELF64 文件头，只用到装载可执行文件需要的部分 */
+#define EI_NIDENT 16
+#define ELFMAG 0x464c457f // "\177ELF"，小端读出
+#define ELFCLASS64 2
+#define ET_EXEC 2
+#define EM_RISCV 243
+
+#define PT_LOAD 1
+
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+
+/* exec 的程序名 (或 SFS 路径) 最大长度 */
+#define EXEC_NAME_LEN 64
+
+/* 一个程序最多装载的 program header 数量 */
+#define ELF_MAX_PHDR 8
+
+typedef struct {
+  unsigned char e_ident[EI_NIDENT];
+  uint16_t e_type;
+  uint16_t e_machine;
+  uint32_t e_version;
+  uint64_t e_entry;
+  uint64_t e_phoff;
+  uint64_t e_shoff;
+  uint32_t e_flags;
+  uint16_t e_ehsize;
+  uint16_t e_phentsize;
+  uint16_t e_phnum;
+  uint16_t e_shentsize;
+  uint16_t e_shnum;
+  uint16_t e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+  uint32_t p_type;
+  uint32_t p_flags;
+  uint64_t p_offset;
+  uint64_t p_vaddr;
+  uint64_t p_paddr;
+  uint64_t p_filesz;
+  uint64_t p_memsz;
+  uint64_t p_align;
+} Elf64_Phdr;
+
+/* users.S 中内置的用户程序 (initramfs)，以 name 为 NULL 的项结尾 */
+struct initramfs_entry {
+  const char *name;
+  uint8_t *data;
+  uint64_t size;
+};
+
+extern struct initramfs_entry initramfs[];
+
+/* 打开的可执行文件：SFS 中的文件 (fd >= 0) 或者 initramfs 中的程序 */
+struct elf_image {
+  int fd;
+  uint8_t *data;
+  uint64_t size;
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr phdr[ELF_MAX_PHDR];
+};
+
+struct mm_struct;
+
+/* 打开 name 并检查文件头，含 '/' 的在 SFS 中查找，否则查 initramfs。成功返回 0 */
+int elf_open(struct elf_image *img, const char *name);
+
+/* 按 PT_LOAD 段建立 mm 的内存区域，成功返回 0 */
+int elf_map(struct elf_image *img, struct mm_struct *mm, uint64_t *pgtbl);
+
+void elf_close(struct elf_image *img);
@@ -1,42 +1,88 @@
 #pragma once
 
 #include "defs.h"
+#include "list.h"
+#include "buf.h"
 
-#define SFS_MAX_INFO_LEN     (4096 - 3 * 4 - 1)
+#define SFS_MAX_INFO_LEN     (4096 - 4 * 4 - 1)
 #define SFS_MAGIC            0x1f2f3f4f
+#define SFS_VERSION_EXTENT   2  // 使用 extent 的磁盘格式
 #define SFS_NDIRECT          11
+#define SFS_NINDIRECT        (SFS_BLOCK_SIZE / 4)
+#define SFS_NEXTENT          32 // inode 中的 extent（或 extent 索引）数量
+#define SFS_LEAF_NEXTENT     ((SFS_BLOCK_SIZE - 4) / sizeof(struct sfs_extent))
 #define SFS_DIRECTORY        1
 #define SFS_MAX_FILENAME_LEN 27
-#define SFS_BUFFER_SIZE (5)
+#define SFS_BUFFER_SIZE (512) // 缓存块数量上限，可按磁盘映像大小调整，内存不足时干净的块会被回收
+#define SFS_HASH_SIZE (61)    // 缓存哈希桶数量，取素数使块号分布均匀
+#define SFS_MAX_RUN (16)      // sfs_read/sfs_write 每次预取的最大块数
+#define SFS_RA_MAX (32)       // 顺序预读窗口的最大块数
+#define SFS_FLUSH_INTERVAL (8) // 每隔多少个时钟中断运行一次回写
+#define SFS_DIRTY_EXPIRE (16)  // 脏块至少放置多少个时钟中断后才被回写
+#define SFS_DELALLOC_BASE (0x80000000u) // 延迟分配的块使用的临时块号从这里开始
+#define SFS_GROUP_BLOCKS (1024) // 空闲块统计的分组大小，须为 64 的倍数
+#define SFS_DCACHE_SIZE (1024) // dentry cache 项数上限
+#define SFS_DCACHE_HASH (61)  // dentry cache 哈希桶数量
+#define SFS_DIR_INDEX_MIN (SFS_BLOCK_SIZE / 32) // 目录项超过一个块时建立哈希索引
+#define SFS_DIR_MAX_DEPTH (9) // 索引根块中桶指针数量为 2^depth，最多 512 个
+#define SFS_DIR_BUCKET_NR ((SFS_BLOCK_SIZE - 8) / sizeof(struct sfs_dir_slot))
+#define SFS_IS_DELALLOC(blockno) ((uint32_t)(blockno) >= SFS_DELALLOC_BASE)
+#define SFS_NO_BUFFER (0xffffffffu) // find_in_dir: 缓冲区没有空间读入目录块
 #define SEEK_CUR 0
 #define SEEK_SET 1
 #define SEEK_END 2
-#define SFS_RECLAIM_THRESHOLD (2) // reclaim threshold
 
 #define SFS_FILE 0
 #define SFS_DIRECTORY 1
 
 #define SFS_FLAG_READ (0x1)
 #define SFS_FLAG_WRITE (0x2)
+#define SFS_FLAG_DIRECT (0x4) // 整块的读写绕过缓存，在磁盘和用户页之间直接传输
 #define SFS_BLOCK_SIZE (4096)
 
 struct sfs_super {
     uint32_t magic;
     uint32_t blocks;
     uint32_t unused_blocks;
+    uint32_t version;   // SFS_VERSION_EXTENT，其他值都按旧格式处理（旧镜像这里是 info 的开头）
     char info[SFS_MAX_INFO_LEN + 1];
 };
 
 
 
 extern struct sfs_meta _meta;
+
+// 文件中 [lblk, lblk + len) 块对应磁盘上 [start, start + len) 块
+// 在 inode 的 extent 索引中，start 为叶子块的块号，lblk 为叶子中第一个 extent 的 lblk，len 不用
+struct sfs_extent {
+    uint32_t lblk;
+    uint32_t start;
+    uint32_t len;
+};
+
+// depth 为 1 时 inode 中放不下的 extent 存放在叶子块中，按 lblk 排序
+struct sfs_extent_leaf {
+    uint32_t nextents;
+    struct sfs_extent ext[SFS_LEAF_NEXTENT];
+};
+
 struct sfs_inode {
     uint32_t size;                 // 文件大小
     uint16_t type;                 // 文件类型，文件/目录
     uint16_t links;                // 硬链接数量
     uint32_t blocks;               // 本文件占用的 block 数量
-    uint32_t direct[SFS_NDIRECT];  // 直接数据块的索引值
-    uint32_t indirect;             // 间接索引块的索引值
+    union {
+        struct {                   // 旧格式
+            uint32_t direct[SFS_NDIRECT];  // 直接数据块的索引值
+            uint32_t indirect;             // 间接索引块的索引值
+        };
+        struct {                   // SFS_VERSION_EXTENT
+            uint32_t depth;        // 0: ext[] 是 extent，1: ext[] 是指向叶子块的索引
+            uint32_t nextents;     // ext[] 中已使用的项数
+            struct sfs_extent ext[SFS_NEXTENT]; // 按 lblk 排序
+        };
+    };
+    uint32_t dir_index;            // 目录的哈希索引根块，0 表示没有索引 (仅 SFS_VERSION_EXTENT)
 };
 
 struct sfs_entry {
@@ -44,6 +90,31 @@ struct sfs_entry {
     char filename[SFS_MAX_FILENAME_LEN + 1]; // 文件名
 };
 
+// 目录哈希索引 (可扩展哈希)：根块中 2^depth 个桶指针，以文件名哈希的低 depth 位选桶，
+// 桶中记录 (哈希, 目录项序号)。目录项本身仍按原格式线性存放，sfs_get_files 不受影响。
+struct sfs_dir_slot {
+    uint32_t hash;        // 文件名的哈希值
+    uint32_t slot;        // 目录项序号，第 slot 个 sfs_entry
+};
+
+struct sfs_dir_root {
+    uint32_t depth;       // 全局深度
+    uint32_t nentries;    // 索引覆盖的目录项数量，与 size / 32 不一致说明索引已过期
+    uint32_t bucket[1 << SFS_DIR_MAX_DEPTH];
+};
+
+struct sfs_dir_bucket {
+    uint32_t depth;       // 局部深度，桶中所有哈希的低 depth 位相同
+    uint32_t count;       // 已使用的项数
+    struct sfs_dir_slot e[SFS_DIR_BUCKET_NR];
+};
+
+// 一次磁盘请求，可覆盖若干个连续的缓存块
+struct sfs_io {
+    struct buf b;
+    int refs;             // 仍指向该请求的缓存块数量，为 0 时释放
+};
+
 struct sfs_memory_block {
     union {
         struct sfs_inode* din;   // 可能是 inode 块
@@ -52,12 +123,55 @@ struct sfs_memory_block {
     bool is_inode;        // 是否是 inode
     uint32_t blockno;     // block 编号
     bool dirty;           // 脏位，保证写回数据
-    int reclaim_count;    // 指向次数，因为硬链接有可能会打开同一个 inode，所以需要记录次数
-    uint32_t reclaim_pid[SFS_RECLAIM_THRESHOLD]; // link list maybe better
+    int pin_count;        // 引用计数，大于 0 时不会被换出（打开的 inode 会一直被 pin 住）
+    struct list_head hash_list; // 哈希链
+    struct list_head lru_list;  // LRU 链表，表头为最近使用
+    struct sfs_io *io;    // 覆盖该块的磁盘请求，没有请求时为 NULL
+    struct list_head dirty_list; // 脏块链表，按变脏的先后排序
+    uint64_t dirtied_at;  // 变脏时的时钟中断计数
+    uint32_t da_inode;    // 延迟分配的块：所属文件的 inode 块号
+    uint32_t da_idx;      // 延迟分配的块：在文件中的块序号
 };
 typedef struct sfs_memory_block mem_block;
 typedef mem_block * mem_block_ptr;
-typedef mem_block_ptr * buffer_t;
+
+struct sfs_buffer {
+    struct list_head hash[SFS_HASH_SIZE]; // 按 blockno 分桶的哈希链
+    struct list_head lru;                 // 所有缓存块，表头最新，表尾最旧
+    struct list_head dirty;               // 所有脏块，表头最早变脏
+    uint32_t nr_blocks;                   // 当前已分配的缓存块数量
+    uint32_t capacity;                    // 缓存块数量上限
+    uint32_t hits;                        // 命中次数
+    uint32_t misses;                      // 未命中次数
+    uint32_t evictions;                   // 换出次数
+    uint32_t writebacks;                  // 换出时写回磁盘的次数
+    uint32_t nr_dirty;                    // 脏块数量
+    uint32_t nr_delalloc;                 // 还没有分配真实块号的块数量
+    uint32_t next_pseudo;                 // 下一个临时块号
+    uint32_t flushes;                     // 定时回写写出的块数
+    uint32_t direct;                      // 绕过缓存直接传输的块数
+    uint32_t shrunk;                      // 内存不足时被 shrinker 释放的块数
+};
+// (父目录, 文件名) -> inode 的缓存项，ino 为 0 表示该名字不存在
+struct sfs_dentry {
+    uint32_t parent;      // 父目录的 inode 编号
+    uint32_t ino;         // 文件的 inode 编号，0 为负项
+    uint32_t hash;        // 文件名的哈希值
+    char name[SFS_MAX_FILENAME_LEN + 1];
+    struct list_head hash_list; // 哈希链
+    struct list_head lru_list;  // LRU 链表，表头为最近使用
+};
+
+struct sfs_dcache {
+    struct list_head hash[SFS_DCACHE_HASH];
+    struct list_head lru;
+    uint32_t nr_dentries;                 // 当前已分配的项数
+    uint32_t capacity;                    // 项数上限
+    uint32_t hits;                        // 命中正项的次数
+    uint32_t neg_hits;                    // 命中负项的次数
+    uint32_t misses;                      // 未命中、需要扫描目录的次数
+    uint32_t updates;                     // 新建文件时改写的项数
+};
 struct sfs_meta{
     uint8_t init;
     uint32_t data_block_start;
@@ -69,8 +183,15 @@ struct sfs_fs {
     struct sfs_super super;           // SFS 的超级块
     bitmap *freemap;           // freemap 区域管理，可自行设计
     bool super_dirty;          // 超级块或 freemap 区域是否有修改
-    buffer_t buffer;          // buffer 
+    uint32_t freemap_blocks;   // freemap 占用的磁盘块数
+    uint8_t *freemap_dirty;    // 每个 freemap 块是否有修改
+    uint32_t ngroups;          // 分组数量
+    uint32_t *group_free;      // 每组的空闲块数
+    uint32_t alloc_hint;       // 下一次分配开始查找的位置
+    struct sfs_buffer buffer;  // block buffer cache
+    struct sfs_dcache dcache;  // dentry cache
 };
+extern struct sfs_fs *__sfs;
 /**
  * 功能: 初始化 simple file system
  * @ret : 成功初始化返回 0，否则返回非 0 值
@@ -143,30 +264,92 @@ int sfs_write(int fd, char* buf, uint32_t len);
  */
 int sfs_get_files(const char* path, char* files[]);
 
+
+struct vm_area_struct;
+/**
+ * 功能    : 把已打开的文件映射到 vma，页面在缺页时才建立映射
+ * @fd    : 该进程打开的文件的 file descriptor (fd)
+ * @vma   : 已填好 vm_start, vm_end, vm_flags 的虚拟内存区域
+ * @offset: 映射起点在文件中的偏移，须按页对齐
+ * @shared: 是否为 MAP_SHARED
+ * @ret   : 成功返回 0，否则返回小于 0 的值
+ */
+int sfs_mmap(int fd, struct vm_area_struct *vma, uint64_t offset, bool shared);
+
+/**
+ * 功能    : 文件映射的缺页处理，返回映射 va 所在页面需要的物理页
+ * @vma   : va 所在的文件映射
+ * @va    : 缺页地址
+ * @write : 是否为写缺页
+ * @perm  : 返回该页的页表权限 (共享映射在第一次写之前是只读的)
+ * @ret   : 物理页地址，0 表示 va 超出了文件末尾
+ */
+uint64_t sfs_fault(struct vm_area_struct *vma, uint64_t va, bool write, int *perm);
+
+/**
+ * 功能    : 解除文件映射，共享映射中写过的块会写回磁盘
+ * @vma   : 文件映射
+ * @pgtbl : 进程的根页表
+ */
+void sfs_munmap(struct vm_area_struct *vma, uint64_t *pgtbl);
+
 // tool functions
 
 static int min(int a, int b);
 static void __strcpy(char * dst, char * src);
 static uint32_t __strlen(const char * str);
 static int __strcmp(const char *a, const char *b);
-static uint32_t hash_fn(uint32_t block_num);
-static int hash_insert(mem_block_ptr block);
-static int hash_look_up(uint32_t block_num);
 static void reset_buffer(uint8_t *buf);
 static int next_file_descriptor();
-int buffer_update(mem_block_ptr node);
+
+// buffer cache (bcache.c)
+void disk_op(int blockno, uint8_t *data, bool write);
+#define disk_read(blockno, data) disk_op((blockno), (data), 0)
+#define disk_write(blockno, data) disk_op((blockno), (data), 1)
+int disk_direct_io(uint32_t blockno, struct buf_seg *seg, int nseg, bool write);
+bool buffer_cached(uint32_t blockno);
+void buffer_init(uint32_t capacity);
+void buffer_stat();
+void buffer_sync();
+uint32_t buffer_flush_block(uint32_t blockno);
+void buffer_prefetch(uint32_t *blocknos, int n, bool is_inode);
+uint32_t buffer_delalloc(uint32_t ino, uint32_t idx);
+uint8_t *buffer_new_block(uint32_t blockno, bool is_inode);
+uint8_t *peek_block(uint32_t blockno);
+void buffer_drop(uint32_t blockno);
+void buffer_flush_aged();
+void sfs_flusher_tick();
+void sfs_lock();
+int sfs_trylock();
+void sfs_unlock();
+bool sfs_lock_held();
 int set_block_dirty(int block_num);
+
+// dentry cache (dcache.c)
+void dcache_init(uint32_t capacity);
+void dcache_stat();
+int dcache_lookup(uint32_t parent, const char *name, uint32_t *ino);
+void dcache_add(uint32_t parent, const char *name, uint32_t ino);
+
 int get_block_from_buffer(uint32_t blockno, struct sfs_memory_block **block);
 int next_free_block();
+uint32_t next_free_block_near(uint32_t goal);
+uint32_t block_goal(struct sfs_inode * inode, uint32_t idx, bool nowait);
+void sfs_sync_super(bool nowait);
+void release_block(uint32_t blockno);
+int set_block_idx(struct sfs_inode * inode, uint32_t block_idx, uint32_t blockno, bool nowait);
+void inode_init(struct sfs_inode * inode, uint16_t type);
 
 int write_block(uint32_t blockno, bool is_inode, uint8_t *buf);
 uint8_t *read_block(uint32_t blockno, bool is_inode);
 uint32_t allocate_block_from_idx(struct sfs_inode * inode, int block_idx);
+uint32_t delalloc_block_from_idx(uint32_t ino, struct sfs_inode * inode, int block_idx);
 uint32_t block_from_idx(struct sfs_inode * inode, int block_idx);
+uint32_t name_hash(const char *name);
 uint32_t find_in_dir(uint32_t dir_inode, const char *name);
-void register_entry(uint32_t dir_inode, char * filename, uint32_t fino);
+int register_entry(uint32_t dir_inode, char * filename, uint32_t fino);
 uint32_t mkdir(uint32_t dir_inode, char *dir_name);
-void init_fd(int fd, uint32_t fino, uint32_t dir_inode, uint32_t flags);
+int init_fd(int fd, uint32_t fino, uint32_t dir_inode, uint32_t flags);
 uint32_t touch(uint32_t dir_inode, char *filename);
 int recycle_block(uint32_t blockno);
 void to_buffer(uint8_t *data_block, bool dirty);
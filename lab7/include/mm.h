@@ -11,27 +11,48 @@
 
 extern uint64_t _end;
 
-static uint64_t alloc_page_num = 0;
-
-typedef struct {
-  bool initialized;
-  uint64_t base_addr;
-  unsigned int bitmap[8192];
-} buddy;
-
-static buddy buddy_system;
-
+/* 已经分配的物理页数 */
 int alloced_page_num();
 
 void init_buddy_system();
 
+/* 分配的页会被清零 */
 uint64_t alloc_pages(unsigned int num);
 
+/* alloc_pages_flags 的 flags */
+#define ALLOC_NOZERO 0x1 // 调用者会马上覆盖整块内存，不需要清零
+
+uint64_t alloc_pages_flags(unsigned int num, int flags);
+
 uint64_t alloc_page();
 
 void free_pages(uint64_t pa);
 
+/* 内存不足时 alloc_pages 在失败前依次调用已注册的 shrinker 回收内存 */
+struct shrinker {
+  const char *name;
+  int seeks;                     /* 被回收的内容重建的代价，小的先调用 */
+  uint64_t (*scan)(uint64_t nr); /* 回收约 nr 页内存，返回释放的页数，0 表示没有可回收的 */
+  struct list_head list;
+  uint64_t nr_calls;
+  uint64_t nr_freed;
+};
+
+void register_shrinker(struct shrinker *s);
+
+void shrinker_stat();
+
+/* 预先清零的页池，空闲时补充，最多清零 max 页，返回清零的页数 */
+int zero_pool_refill(int max);
+
+void zero_pool_stat();
+
 void slub_init();
 
-void memcpy(void * dst, void * src, size_t size);
-void *memset(void *dst, int c, uint32_t n);
+/* string.c，按字 (或 RVV) 处理 */
+void *memcpy(void *dst, const void *src, size_t size);
+void *memmove(void *dst, const void *src, size_t size);
+void *memset(void *dst, int c, size_t n);
+
+/* 测量 memcpy/memset 的吞吐，用 -DMEM_BENCH 编译时启动时运行 */
+void mem_bench();
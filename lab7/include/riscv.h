@@ -1,5 +1,7 @@
 #pragma once
 
+#define SSTATUS_VS_INITIAL (1UL << 9) // sstatus.VS = Initial
+
 #define write_csr(reg, val)                                     \
   ({                                                            \
     if (__builtin_constant_p(val) && (unsigned long)(val) < 32) \
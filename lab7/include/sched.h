@@ -5,6 +5,12 @@
 
 void call_first_process(void);
 
+/* 有被磁盘中断唤醒的进程，下次时钟中断时重新调度 */
+extern int need_resched;
+
+/* 时钟中断计数 */
+extern uint64_t jiffies;
+
 /* 在时钟中断处理中被调用 */
 void do_timer(void);
 
@@ -3,7 +3,7 @@
 #include "list.h"
 #include "defs.h"
 
-#define NR_PARTIAL 9
+#define NR_PARTIAL 13
 #define PAGE_SHIFT 12
 #define PPN_SHIFT 10
 #define PAGE_MASK (~((1UL << PAGE_SHIFT) - 1))
@@ -18,6 +18,7 @@ struct page {
   struct list_head slub_list;
   struct kmem_cache *slub; /* Pointer to slab */
   void *freelist;
+  int refcount; /* user mappings of the page, 0 and 1 both mean one */
 };
 
 struct cache_area {
@@ -41,6 +42,7 @@ struct kmem_cache {
   unsigned long nr_page_per_slub;
 
   void (*init_func)(void *);
+  unsigned long flags;       /* SLAB_* */
   unsigned int inuse;        /* Offset to metadata */
   unsigned int align;        /* Alignment */
   unsigned int red_left_pad; /* Left redzone padding size */
@@ -49,14 +51,18 @@ struct kmem_cache {
 
   /* kmem_cache_node */
   unsigned long nr_partial;
-  struct list_head partial;
-#ifdef CONFIG_SLUB_DEBUG
+  struct list_head partial; /* Slabs with some free objects */
   unsigned long nr_slabs;
   unsigned long total_objects;
-  struct list_head full;
-#endif
+  struct list_head full; /* Slabs with no free object */
+
+  unsigned long nr_allocs;
+  unsigned long nr_frees;
 };
 
+/* kmem_cache_create 的 flags */
+#define SLAB_NOZERO 0x1 /* 分配时不清零对象，调用者会完整写入 */
+
 void slub_init();
 struct kmem_cache *kmem_cache_create(const char *, size_t, unsigned int, int,
                                      void *(void *));
@@ -66,3 +72,10 @@ void kmem_cache_free(void *);
 
 void *kmalloc(size_t);
 void kfree(const void *);
+
+/* 每个 kmalloc 大小类的分配次数和内部碎片 */
+void kmalloc_stat();
+
+void page_ref_inc(uint64_t pa);
+bool page_ref_dec(uint64_t pa);
+int page_ref(uint64_t pa);
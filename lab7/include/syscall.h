@@ -19,6 +19,8 @@
 #define SFS_WRITE     1005
 #define SFS_GET_FILES 1006
 
+#define SYS_KSTAT 1100 // 打印内核的统计信息
+
 struct ret_info {
   uint64_t a0;
   uint64_t a1;
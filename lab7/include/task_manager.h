@@ -4,6 +4,9 @@
 #include "list.h"
 
 #define TASK_SIZE (4096)
+/* 用户栈是一个普通的匿名内存区域 */
+#define USER_STACK_START 0x1002000
+#define USER_STACK_SIZE 0x2000
 #define THREAD_OFFSET (5 * 0x08)
 
 #ifndef __ASSEMBLER__
@@ -69,15 +72,24 @@ struct vm_area_struct {
   pgprot_t vm_page_prot;
   /* Flags*/
   unsigned long vm_flags;
-  /* mapped */
-  bool mapped;
+  /* one bit per page of anonymous memory, set once the page is mapped */
+  uint8_t *vm_pages;
+  /* pages mapped so far, the area's part of the task's RSS */
+  uint32_t vm_rss;
+  /* file mapping: inode block of the file, 0 for anonymous memory */
+  uint32_t vm_ino;
+  /* file offset of vm_start, page aligned */
+  uint64_t vm_offset;
+  /* MAP_SHARED: pages are the file's buffer blocks, stores reach the file */
+  bool vm_shared;
+  /* read-only program pages in the kernel image: physical address of vm_start */
+  uint64_t vm_image;
 };
 
 /* 内存管理 */
 struct mm_struct {
   struct vm_area_struct *vm;   // 虚拟内存区域描述符
-  uint64_t user_program_start; // 进程起始地址（物理）
-  uint64_t user_stack;         // 用户栈地址(物理)
+  uint64_t asid;               // 代数 << ASID_GEN_SHIFT | ASID
 };
 
 struct file {
@@ -88,6 +100,11 @@ struct file {
   uint64_t flags;
   uint64_t off;
   // 可以增加额外数据来辅助你的缓存管理
+  // 顺序预读窗口，单位为文件内块号
+  uint32_t ra_start;      // 窗口起始块
+  uint32_t ra_size;       // 窗口块数，0 表示没有窗口
+  uint32_t ra_async_size; // 读到 ra_start + ra_size - ra_async_size 时提前预读下一窗口
+  uint32_t ra_prev;       // 上次读到的块 + 1，用来判断是否顺序访问
 };
 
 struct files_struct {
@@ -50,9 +50,18 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// this many virtio descriptors, i.e. requests in flight when indirect
+// descriptors are available. must be a power of two and no larger than
+// the device's QUEUE_NUM_MAX (virtio_disk_init() checks it).
+// build with -DVIRTIO_QUEUE_NUM=n to change it.
+#ifndef VIRTIO_QUEUE_NUM
+#define VIRTIO_QUEUE_NUM 32
+#endif
+#define NUM VIRTIO_QUEUE_NUM
+
+#if (NUM & (NUM - 1)) != 0 || NUM > 32768
+#error "VIRTIO_QUEUE_NUM must be a power of two <= 32768"
+#endif
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -63,13 +72,14 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr/len point to a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
   uint16_t flags; // always zero
   uint16_t idx;   // driver will write ring[idx] next
   uint16_t ring[NUM]; // descriptor numbers of chain heads
-  uint16_t unused;
+  uint16_t used_event; // VIRTIO_RING_F_EVENT_IDX: interrupt once used->idx passes this
 };
 
 // one entry in the "used" ring, with which the
@@ -83,8 +93,23 @@ struct virtq_used {
   uint16_t flags; // always zero
   uint16_t idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16_t avail_event; // VIRTIO_RING_F_EVENT_IDX: notify once avail->idx passes this
 };
 
+// the legacy layout of the three regions: avail follows the descriptors,
+// used starts on the next page boundary.
+#define VIRTQ_ALIGN(x) (((x) + 4095) & ~4095)
+#define VIRTQ_AVAIL_OFF (NUM * sizeof(struct virtq_desc))
+#define VIRTQ_USED_OFF VIRTQ_ALIGN(VIRTQ_AVAIL_OFF + sizeof(struct virtq_avail))
+#define VIRTQ_SIZE (VIRTQ_USED_OFF + VIRTQ_ALIGN(sizeof(struct virtq_used)))
+
+// from the spec: true if moving an index from old to new_idx
+// crossed event_idx, i.e. the other side asked to be told.
+static inline int vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old)
+{
+  return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
+}
+
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
@@ -102,6 +127,11 @@ struct virtio_blk_req {
 
 void plic_init(void);
 void virtio_disk_init(void);
+void virtio_disk_submit(struct buf *b, int write);
+int virtio_disk_wait(struct buf *b);
 void virtio_disk_rw(struct buf *b, int write);
+void virtio_disk_plug(void);
+void virtio_disk_unplug(void);
 void virtio_disk_intr();
-int plic_claim(void);
\ No newline at end of file
+int plic_claim(void);
+void plic_complete(int irq);
\ No newline at end of file
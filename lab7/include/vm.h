@@ -7,6 +7,21 @@
 #define PTE_W 0x004 // Write
 #define PTE_X 0x008 // Execute
 #define PTE_U 0x010 // User
+#define PTE_G 0x020 // Global, the kernel mappings of every address space
+
+#define MAP_SHARED 0x01    // file mapping, stores go to the file
+#define MAP_PRIVATE 0x02   // file mapping, private copy of the pages
+#define MAP_ANONYMOUS 0x20 // no file, also the meaning of flags 0
+
+// file mappings map this many pages around a read fault (aligned group)
+#define FAULT_AROUND_PAGES 4
+
+// satp: MODE[63:60] ASID[59:44] PPN[43:0]
+#define SATP_SV39 0x8000000000000000
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK (0xffffUL << SATP_ASID_SHIFT)
+// mm.asid keeps the generation above the ASID
+#define ASID_GEN_SHIFT 16
 
 #define PHYSICAL_ADDR(x) (((uint64_t)(x)) & 0xffffffff | 0x80000000)
 #define VIRTUAL_ADDR(x) (((uint64_t)(x)) & 0xfffffff | 0xffffffc000000000)
@@ -15,5 +30,36 @@ void create_mapping(uint64_t *pgtbl, uint64_t va, uint64_t pa, uint64_t sz,
                     int perm);
 
 uint64_t get_pte(uint64_t *pgtbl, uint64_t va);
+void unmap_range(uint64_t *pgtbl, uint64_t va, uint64_t sz);
 
 void paging_init();
+
+extern uint64_t *kernel_pgtbl;
+uint64_t *pgtbl_alloc();
+void pgtbl_free(uint64_t *pgtbl);
+void pgtbl_stat();
+bool kernel_range(uint64_t start, uint64_t end);
+
+struct task_struct;
+
+void asid_init();
+uint64_t asid_satp(uint64_t *pgtbl, uint64_t asid);
+uint64_t asid_alloc();
+void asid_switch(struct task_struct *next);
+void flush_tlb_page(uint64_t va);
+void flush_tlb_range(uint64_t start, uint64_t end);
+void flush_tlb_mm();
+
+struct vm_area_struct;
+struct mm_struct;
+
+int vma_init(struct vm_area_struct *vma);
+struct vm_area_struct *vma_add(struct mm_struct *mm, uint64_t start, uint64_t len,
+                               uint64_t flags);
+void vma_prefault(uint64_t va, uint64_t len, bool write);
+uint64_t vma_nr_pages(struct vm_area_struct *vma);
+bool vma_present(struct vm_area_struct *vma, uint64_t va);
+int vma_fault(struct vm_area_struct *vma, uint64_t *pgtbl, uint64_t va, bool write);
+int vma_copy(struct vm_area_struct *dst, struct vm_area_struct *src,
+             uint64_t *dst_pgtbl, uint64_t *src_pgtbl);
+void vma_unmap(struct vm_area_struct *vma, uint64_t *pgtbl);
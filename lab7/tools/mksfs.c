@@ -6,7 +6,9 @@ typedef unsigned int uint32_t;
 
 #define SFS_MAX_INFO_LEN     32
 #define SFS_MAGIC            0x1f2f3f4f
+#define SFS_VERSION_EXTENT   2
 #define SFS_NDIRECT          11
+#define SFS_NEXTENT          32
 #define SFS_DIRECTORY        1
 #define SFS_MAX_FILENAME_LEN 27
 
@@ -14,16 +16,33 @@ struct sfs_super {
     uint32_t magic;
     uint32_t blocks;
     uint32_t unused_blocks;
+    uint32_t version;
     char info[SFS_MAX_INFO_LEN + 1];
 };
 
+struct sfs_extent {
+    uint32_t lblk;
+    uint32_t start;
+    uint32_t len;
+};
+
 struct sfs_inode {
     uint32_t size;                 // 文件大小
     uint16_t type;                 // 文件类型，文件/目录
     uint16_t links;                // 硬链接数量
     uint32_t blocks;               // 本文件占用的 block 数量
-    uint32_t direct[SFS_NDIRECT];  // 直接数据块的索引值
-    uint32_t indirect;             // 间接索引块的索引值
+    union {
+        struct {                   // 旧格式
+            uint32_t direct[SFS_NDIRECT];  // 直接数据块的索引值
+            uint32_t indirect;             // 间接索引块的索引值
+        };
+        struct {                   // SFS_VERSION_EXTENT
+            uint32_t depth;
+            uint32_t nextents;
+            struct sfs_extent ext[SFS_NEXTENT];
+        };
+    };
+    uint32_t dir_index;            // 目录哈希索引根块，新镜像的根目录没有索引
 };
 
 struct sfs_entry {
@@ -32,24 +51,42 @@ struct sfs_entry {
 };
 
 int main(int argc, char *argv[]) {
+    // -v1 keeps the old direct/indirect inode format
+    int extents = 1;
+    if (argc == 3 && strcmp(argv[1], "-v1") == 0) {
+        extents = 0;
+        argv++;
+        argc--;
+    }
     if (argc != 2) {
-        printf("Usage: mksfs sfs.img\n");
+        printf("Usage: mksfs [-v1] sfs.img\n");
         return -1;
     }
     
     struct sfs_super super_block;
+    memset(&super_block, 0, sizeof(super_block));
     super_block.magic         = SFS_MAGIC;
     super_block.blocks        = 4096;
     super_block.unused_blocks = 4096 - 4;
+    super_block.version       = extents ? SFS_VERSION_EXTENT : 1;
     strcpy(super_block.info, "Hello My Simple File System!");
 
     struct sfs_inode root_inode;
+    memset(&root_inode, 0, sizeof(root_inode));
     root_inode.size      = sizeof(struct sfs_entry);
     root_inode.type      = SFS_DIRECTORY;
     root_inode.links     = 1;
     root_inode.blocks    = 1;
-    root_inode.direct[0] = 3;
-    root_inode.indirect  = 0;
+    if (extents) {
+        root_inode.depth       = 0;
+        root_inode.nextents    = 1;
+        root_inode.ext[0].lblk = 0;
+        root_inode.ext[0].start = 3;
+        root_inode.ext[0].len  = 1;
+    } else {
+        root_inode.direct[0] = 3;
+        root_inode.indirect  = 0;
+    }
 
     char freemap[4096];
     memset(freemap, 0, sizeof(freemap));